@@ -0,0 +1,627 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include "simple.h"
+#include "trace.h"
+
+/*
+ * Inode and block bitmaps carry one bit per inode number / per block of
+ * the image, set when in use.  mkfs-simplefs sizes them from the image and
+ * marks the bits past the end as used.  All bitmap blocks stay in memory
+ * while the filesystem is mounted.
+ *
+ * For allocation the image is cut into groups of s_blocks_per_group
+ * blocks, as chosen by mkfs, each paired with an equal, power of two
+ * share of the inode numbers.  Only the group size is on disk: the free
+ * counts are rebuilt from the bitmaps at mount time, and each group has
+ * its own lock, so CPUs allocating in different groups never meet.  A
+ * new inode goes into its parent's group, new top-level directories are
+ * spread over the emptier groups, and a file's data starts in its inode's
+ * group.  The totals are per-CPU counters, folded back into the super
+ * block when it is synced.
+ */
+
+static inline struct simplefs_group *simplefs_group(struct simplefs_sb_info *sbinfo,
+		unsigned int g)
+{
+	return &sbinfo->s_groups[g];
+}
+
+/* Clear bits in [@lo, @hi) of one bitmap block, @lo a multiple of 8 */
+static unsigned int simplefs_count_free(const void *map, unsigned int lo, unsigned int hi)
+{
+	unsigned int i, used = memweight(map + lo / 8, (hi - lo) / 8);
+
+	for (i = lo + (hi - lo) / 8 * 8; i < hi; i++)
+		used += test_bit_le(i, map);
+	return hi - lo - used;
+}
+
+static int simplefs_bitmap_load(struct super_block *s, struct simplefs_bitmap *map,
+		uint64_t start, uint64_t blocks, uint64_t nbits)
+{
+	unsigned int bpb = s->s_blocksize << 3;
+	unsigned int i;
+
+	if (!blocks || DIV_ROUND_UP(nbits, bpb) != blocks)
+		return -EINVAL;
+
+	map->blocks = blocks;
+	map->nbits = nbits;
+	map->bh = kcalloc(blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!map->bh)
+		return -ENOMEM;
+
+	for (i = 0; i < blocks; i++) {
+		map->bh[i] = sb_bread(s, start + i);
+		if (!map->bh[i])
+			return -EIO;
+	}
+	return 0;
+}
+
+static void simplefs_bitmap_put(struct simplefs_bitmap *map)
+{
+	unsigned int i;
+
+	if (map->bh) {
+		for (i = 0; i < map->blocks; i++)
+			brelse(map->bh[i]);
+	}
+	kfree(map->bh);
+	map->bh = NULL;
+}
+
+/* Clear bits of @map in [@lo, @hi), a bitmap block at a time */
+static uint64_t simplefs_bitmap_count(struct super_block *s, struct simplefs_bitmap *map,
+		uint64_t lo, uint64_t hi)
+{
+	unsigned int bpb = s->s_blocksize << 3;
+	uint64_t base, end, free = 0;
+
+	for (; lo < hi; lo = end) {
+		base = lo - lo % bpb;
+		end = min(hi, base + bpb);
+		free += simplefs_count_free(map->bh[lo / bpb]->b_data, lo - base, end - base);
+	}
+	return free;
+}
+
+/*
+ * Claim a run of up to *len clear bits in [@lo, @hi), which lies within
+ * one bitmap block, taking the run at @lo if that bit is free and
+ * otherwise the first run of the wanted length, or the longest one.  The
+ * search moves a word at a time.  Returns the first bit, or -1.  Called
+ * with the group lock held.
+ */
+static int64_t simplefs_bitmap_claim(struct simplefs_bitmap *map, unsigned int bpb,
+		uint64_t lo, uint64_t hi, unsigned int *len)
+{
+	uint64_t base = lo - lo % bpb;
+	void *data = map->bh[lo / bpb]->b_data;
+	unsigned int l = lo - base, h = hi - base;
+	unsigned int bit, end, best = 0, bestlen = 0;
+
+	bit = find_next_zero_bit_le(data, h, l);
+	while (bit < h) {
+		end = find_next_bit_le(data, min(h, bit + *len), bit);
+		if (end - bit > bestlen) {
+			best = bit;
+			bestlen = end - bit;
+		}
+		/* a free goal block is always taken, to stay contiguous */
+		if (bestlen >= *len || bit == l)
+			break;
+		bit = find_next_zero_bit_le(data, h, end);
+	}
+	if (!bestlen)
+		return -1;
+
+	for (bit = best; bit < best + bestlen; bit++)
+		__set_bit_le(bit, data);
+	*len = bestlen;
+	return base + best;
+}
+
+/*
+ * Claim up to *len bits of group @grp, whose bits in @map are [@lo, @hi),
+ * searching from @goal to the end of the group and then from its start.
+ * *free is the group's matching free count.  Returns the first bit, or
+ * -ENOSPC when the group is full.
+ */
+static int64_t simplefs_group_claim(struct super_block *s, struct simplefs_group *grp,
+		struct simplefs_bitmap *map, uint64_t lo, uint64_t hi, uint64_t goal,
+		unsigned int *len, unsigned int *free)
+{
+	unsigned int bpb = s->s_blocksize << 3;
+	uint64_t from = goal > lo && goal < hi ? goal : lo;
+	uint64_t range[2][2] = { { from, hi }, { lo, from } };
+	struct buffer_head *bh;
+	unsigned int pass;
+	uint64_t pos, end;
+	int64_t bit;
+	int err;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (pos = range[pass][0]; pos < range[pass][1]; pos = end) {
+			end = min(range[pass][1], pos - pos % bpb + bpb);
+			if (!READ_ONCE(*free))
+				return -ENOSPC;
+			bh = map->bh[pos / bpb];
+			/* the journal has to see the block before it changes */
+			err = simplefs_get_write_access(bh);
+			if (err)
+				return err;
+			spin_lock(&grp->lock);
+			bit = simplefs_bitmap_claim(map, bpb, pos, end, len);
+			if (bit >= 0)
+				*free -= *len;
+			spin_unlock(&grp->lock);
+			if (bit >= 0) {
+				simplefs_dirty_metadata(bh, NULL);
+				return bit;
+			}
+		}
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Clear @len bits of @map starting at @start, all within group @grp, and
+ * count in *freed how many were set.  Stops at the first bitmap block the
+ * journal refuses, with the bits from there on still set.
+ */
+static int simplefs_group_free(struct super_block *s, struct simplefs_group *grp,
+		struct simplefs_bitmap *map, uint64_t start, unsigned int len,
+		unsigned int *freed)
+{
+	unsigned int bpb = s->s_blocksize << 3;
+	uint64_t bit = start, next;
+	unsigned int b;
+	int err;
+
+	*freed = 0;
+	while (bit < start + len) {
+		b = bit / bpb;
+		next = min_t(uint64_t, start + len, (uint64_t)(b + 1) * bpb);
+		err = simplefs_get_write_access(map->bh[b]);
+		if (err)
+			return err;
+		spin_lock(&grp->lock);
+		for (; bit < next; bit++) {
+			if (!__test_and_clear_bit_le(bit % bpb, map->bh[b]->b_data)) {
+				printk(KERN_ERR "simplefs: %s: bit %llu already free\n",
+						s->s_id, (unsigned long long)bit);
+				continue;
+			}
+			(*freed)++;
+		}
+		spin_unlock(&grp->lock);
+		simplefs_dirty_metadata(map->bh[b], NULL);
+	}
+	return 0;
+}
+
+/* A bit that cannot be cleared is lost until fsck; keep it out of the log */
+static int simplefs_free_failed(struct super_block *s, const char *what,
+		uint64_t nr, int err)
+{
+	printk(KERN_ERR "simplefs: %s: cannot free %s %llu: %d\n",
+			s->s_id, what, (unsigned long long)nr, err);
+	simplefs_journal_abort(s, err);
+	return err;
+}
+
+/*
+ * Blocks that neither hold data nor are promised to delayed allocation.
+ * The per-CPU reads can be off by a batch per CPU, so count exactly once
+ * the answer gets close.
+ */
+static s64 simplefs_avail_blocks(struct simplefs_sb_info *sbinfo)
+{
+	s64 avail = percpu_counter_read_positive(&sbinfo->s_free_blocks) -
+		    percpu_counter_read_positive(&sbinfo->s_reserved_blocks);
+
+	if (avail < 4 * (s64)percpu_counter_batch * num_online_cpus())
+		avail = percpu_counter_sum_positive(&sbinfo->s_free_blocks) -
+			percpu_counter_sum_positive(&sbinfo->s_reserved_blocks);
+	return max_t(s64, avail, 0);
+}
+
+/*
+ * Where the data of @inode starts when nothing precedes it: in the inode's
+ * group, at an offset that depends on the CPU so that files written in
+ * parallel do not chase each other through the same blocks.
+ */
+sector_t simplefs_data_goal(struct inode *inode)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(inode->i_sb);
+	unsigned int g = inode->i_ino / sbinfo->s_inodes_per_group;
+
+	return (sector_t)g * sbinfo->s_blocks_per_group +
+		(raw_smp_processor_id() % 8) * (sbinfo->s_blocks_per_group / 8);
+}
+
+/*
+ * Allocate up to *count contiguous data blocks, preferring a run that
+ * starts at @goal.  The goal's group is tried first; when it is full the
+ * search moves on from the group this CPU last found room in.  On success
+ * *start is the first block and *count the number of blocks actually
+ * obtained (at least one).  @reserved of them may come out of the caller's
+ * own delayed allocation reservation, which it gives back afterwards.
+ */
+int simplefs_new_blocks(struct super_block *s, sector_t goal,
+		unsigned int *count, sector_t *start, unsigned int reserved)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	unsigned int n = sbinfo->s_groups_count, bpg = sbinfo->s_blocks_per_group;
+	unsigned int g, hint, i;
+	struct simplefs_group *grp;
+	uint64_t lo, hi;
+	int64_t blk = -ENOSPC;
+	s64 avail;
+
+	if (goal < sb->data_block || goal >= sb->blocks_count)
+		goal = sb->data_block;
+
+	/* blocks promised to delayed allocation are not up for grabs */
+	avail = simplefs_avail_blocks(sbinfo) + reserved;
+	if (!avail) {
+		trace_simplefs_new_blocks(s, goal, 0, 0, -ENOSPC);
+		return -ENOSPC;
+	}
+	*count = min_t(s64, *count, avail);
+
+	hint = this_cpu_read(*sbinfo->s_group_hint);
+	for (i = 0; i <= n; i++) {
+		g = i ? (hint + i - 1) % n : goal / bpg;
+		grp = simplefs_group(sbinfo, g);
+		lo = (uint64_t)g * bpg;
+		hi = min_t(uint64_t, lo + bpg, sb->blocks_count);
+		blk = simplefs_group_claim(s, grp, &sbinfo->dmap, lo, hi, goal,
+				count, &grp->free_blocks);
+		if (blk == -ENOSPC)
+			continue;
+		if (blk < 0)
+			break;
+		if (i)
+			this_cpu_write(*sbinfo->s_group_hint, g);
+		percpu_counter_sub(&sbinfo->s_free_blocks, *count);
+		*start = blk;
+		trace_simplefs_new_blocks(s, goal, blk, *count, 0);
+		return 0;
+	}
+	trace_simplefs_new_blocks(s, goal, 0, 0, blk);
+	return blk;
+}
+
+int simplefs_free_blocks(struct super_block *s, sector_t start,
+		unsigned int count)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	unsigned int bpg = sbinfo->s_blocks_per_group;
+	struct simplefs_group *grp;
+	unsigned int g, n, freed;
+	int err;
+
+	trace_simplefs_free_blocks(s, start, count);
+	if (start < sb->data_block || start + count > sb->blocks_count) {
+		printk(KERN_ERR "simplefs: freeing blocks outside data area %s:%lu+%u\n",
+				s->s_id, (unsigned long)start, count);
+		return -EIO;
+	}
+
+	while (count) {
+		g = start / bpg;
+		n = min_t(sector_t, count, (sector_t)(g + 1) * bpg - start);
+		grp = simplefs_group(sbinfo, g);
+		err = simplefs_group_free(s, grp, &sbinfo->dmap, start, n, &freed);
+		spin_lock(&grp->lock);
+		grp->free_blocks += freed;
+		spin_unlock(&grp->lock);
+		percpu_counter_add(&sbinfo->s_free_blocks, freed);
+		if (err)
+			return simplefs_free_failed(s, "block", start, err);
+		start += n;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Delayed allocation takes blocks off the free count without choosing
+ * them; writeback allocates out of the reservation and then gives back
+ * as much of it as it got blocks for.
+ */
+int simplefs_reserve_blocks(struct super_block *s, unsigned int count)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+
+	if (simplefs_avail_blocks(sbinfo) < count)
+		return -ENOSPC;
+	percpu_counter_add(&sbinfo->s_reserved_blocks, count);
+	return 0;
+}
+
+void simplefs_release_blocks(struct super_block *s, unsigned int count)
+{
+	percpu_counter_sub(&simplefs_sb(s)->s_reserved_blocks, count);
+}
+
+/*
+ * Orlov: put a new top-level directory in the group with the fewest
+ * directories among those with more free inodes and blocks than average,
+ * scanning from a random group.  Returns -1 when no group qualifies.
+ */
+static int simplefs_find_group_orlov(struct simplefs_sb_info *sbinfo)
+{
+	unsigned int n = sbinfo->s_groups_count, i, g, dirs, best_dirs = UINT_MAX;
+	s64 avg_inodes = percpu_counter_read_positive(&sbinfo->s_free_inodes) / n;
+	s64 avg_blocks = percpu_counter_read_positive(&sbinfo->s_free_blocks) / n;
+	unsigned int start = prandom_u32() % n;
+	struct simplefs_group *grp;
+	int best = -1;
+
+	for (i = 0; i < n; i++) {
+		g = (start + i) % n;
+		grp = simplefs_group(sbinfo, g);
+		if (!READ_ONCE(grp->free_inodes) ||
+		    READ_ONCE(grp->free_inodes) < avg_inodes ||
+		    READ_ONCE(grp->free_blocks) < avg_blocks)
+			continue;
+		dirs = READ_ONCE(grp->dirs);
+		if (dirs < best_dirs) {
+			best = g;
+			best_dirs = dirs;
+		}
+	}
+	return best;
+}
+
+/*
+ * Returns a free inode number for a new child of @dir, or 0 when the
+ * inode table is full.
+ */
+unsigned long simplefs_new_inode_no(struct super_block *s, struct inode *dir, umode_t mode)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	unsigned int n = sbinfo->s_groups_count, ipg = sbinfo->s_inodes_per_group;
+	unsigned int g, first, hint, i, len;
+	struct simplefs_group *grp;
+	uint64_t lo, hi;
+	int64_t ino;
+	int orlov = -1;
+
+	if (S_ISDIR(mode) && dir->i_ino == SIMPLEFS_ROOTDIR_INODE_NUMBER)
+		orlov = simplefs_find_group_orlov(sbinfo);
+	first = orlov >= 0 ? orlov : dir->i_ino / ipg;
+
+	hint = this_cpu_read(*sbinfo->s_group_hint);
+	for (i = 0; i <= n; i++) {
+		g = i ? (hint + i - 1) % n : first;
+		lo = (uint64_t)g * ipg;
+		hi = min_t(uint64_t, lo + ipg, sbinfo->imap.nbits);
+		if (lo >= hi)
+			continue;
+		grp = simplefs_group(sbinfo, g);
+		len = 1;
+		ino = simplefs_group_claim(s, grp, &sbinfo->imap, lo, hi, lo,
+				&len, &grp->free_inodes);
+		if (ino == -ENOSPC)
+			continue;
+		if (ino < 0)
+			break;
+		if (S_ISDIR(mode)) {
+			spin_lock(&grp->lock);
+			grp->dirs++;
+			spin_unlock(&grp->lock);
+		}
+		percpu_counter_dec(&sbinfo->s_free_inodes);
+		trace_simplefs_new_inode(s, ino, mode);
+		return ino;
+	}
+	trace_simplefs_new_inode(s, 0, mode);
+	return 0;
+}
+
+int simplefs_free_inode_no(struct super_block *s, unsigned long ino, umode_t mode)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_group *grp;
+	unsigned int freed;
+	int err;
+
+	trace_simplefs_free_inode(s, ino, mode);
+	if (ino < SIMPLEFS_ROOTDIR_INODE_NUMBER || ino >= sbinfo->imap.nbits) {
+		printk(KERN_ERR "simplefs: freeing bad inode number %s:%lu\n", s->s_id, ino);
+		return -EIO;
+	}
+
+	grp = simplefs_group(sbinfo, ino / sbinfo->s_inodes_per_group);
+	err = simplefs_group_free(s, grp, &sbinfo->imap, ino, 1, &freed);
+	if (err)
+		return simplefs_free_failed(s, "inode", ino, err);
+	spin_lock(&grp->lock);
+	grp->free_inodes += freed;
+	if (freed && S_ISDIR(mode))
+		grp->dirs--;
+	spin_unlock(&grp->lock);
+	percpu_counter_add(&sbinfo->s_free_inodes, freed);
+	return 0;
+}
+
+/*
+ * Clear the slots of the free inodes in the inode table block @bh, whose
+ * first slot is inode @ino.  The group lock keeps simplefs_new_inode_no()
+ * from handing out the one being cleared; a slot that is in use belongs
+ * to its inode and is left alone.
+ */
+void simplefs_zero_free_inodes(struct super_block *s, struct buffer_head *bh,
+		unsigned long ino)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_inode *sinode = (struct simplefs_inode *)bh->b_data;
+	unsigned int bpb = s->s_blocksize << 3, i;
+	struct simplefs_group *grp;
+
+	for (i = 0; i < SIMPLEFS_INODES_PER_BLOCK; i++, ino++, sinode++) {
+		if (ino >= sbinfo->imap.nbits) {
+			memset(sinode, 0, sizeof(*sinode));
+			continue;
+		}
+		grp = simplefs_group(sbinfo, ino / sbinfo->s_inodes_per_group);
+		spin_lock(&grp->lock);
+		if (!test_bit_le(ino % bpb, sbinfo->imap.bh[ino / bpb]->b_data))
+			memset(sinode, 0, sizeof(*sinode));
+		spin_unlock(&grp->lock);
+	}
+}
+
+/*
+ * Fold the per-CPU totals back into the super block.  Nothing relies on
+ * them there: a mount counts everything again from the bitmaps.
+ */
+void simplefs_sync_counts(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	handle_t *handle;
+
+	handle = simplefs_journal_start(s, 1);
+	if (IS_ERR(handle))
+		return;
+	if (!simplefs_get_write_access(sbinfo->sbh)) {
+		lock_buffer(sbinfo->sbh);
+		sb->free_blocks = percpu_counter_sum_positive(&sbinfo->s_free_blocks);
+		sb->free_inodes = percpu_counter_sum_positive(&sbinfo->s_free_inodes);
+		sb->inodes_count = sb->max_inodes - sb->free_inodes;
+		unlock_buffer(sbinfo->sbh);
+		simplefs_dirty_metadata(sbinfo->sbh, NULL);
+	}
+	simplefs_journal_stop(handle);
+}
+
+/* Count the directories of each group, which only the inodes tell */
+static void simplefs_count_dirs(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_bitmap *map = &sbinfo->imap;
+	unsigned int bpb = s->s_blocksize << 3;
+	struct simplefs_inode *sinode;
+	struct buffer_head *bh;
+	unsigned int b, bit, nbits;
+	unsigned long ino;
+
+	for (b = 0; b < map->blocks; b++) {
+		nbits = min_t(uint64_t, bpb, map->nbits - (uint64_t)b * bpb);
+		for (bit = find_next_bit_le(map->bh[b]->b_data, nbits, 0); bit < nbits;
+		     bit = find_next_bit_le(map->bh[b]->b_data, nbits, bit + 1)) {
+			ino = (unsigned long)b * bpb + bit;
+			if (ino < SIMPLEFS_ROOTDIR_INODE_NUMBER)
+				continue;
+			sinode = simplefs_raw_inode(s, ino, &bh);
+			if (!IS_ERR(sinode) && S_ISDIR(sinode->mode))
+				sbinfo->s_groups[ino / sbinfo->s_inodes_per_group].dirs++;
+		}
+	}
+}
+
+/* Size the groups and count what each of them has free */
+static int simplefs_load_groups(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	uint64_t lo, hi, free_blocks = 0, free_inodes = 0;
+	struct simplefs_group *grp;
+	uint64_t bpg = sb->blocks_per_group;
+	unsigned int n, ipg, g, cpu;
+	int err;
+
+	if (!bpg)
+		bpg = SIMPLEFS_BLOCKS_PER_GROUP;
+	if (!is_power_of_2(bpg) || bpg < SIMPLEFS_MIN_BLOCKS_PER_GROUP ||
+	    bpg > SIMPLEFS_MAX_BLOCKS_PER_GROUP) {
+		printk(KERN_ERR "simplefs: %s: bad allocation group size %llu\n",
+				s->s_id, (unsigned long long)sb->blocks_per_group);
+		return -EINVAL;
+	}
+	n = DIV_ROUND_UP(sb->blocks_count, bpg);
+	ipg = max_t(unsigned int, 64,
+		    roundup_pow_of_two(DIV_ROUND_UP(sbinfo->imap.nbits, n)));
+	sbinfo->s_groups_count = n;
+	sbinfo->s_blocks_per_group = bpg;
+	sbinfo->s_inodes_per_group = ipg;
+	sbinfo->s_groups = kcalloc(n, sizeof(struct simplefs_group), GFP_KERNEL);
+	sbinfo->s_group_hint = alloc_percpu(unsigned int);
+	if (!sbinfo->s_groups || !sbinfo->s_group_hint)
+		return -ENOMEM;
+	/* CPUs that have to leave their goal group fan out from different places */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(sbinfo->s_group_hint, cpu) = cpu % n;
+
+	for (g = 0; g < n; g++) {
+		grp = simplefs_group(sbinfo, g);
+		spin_lock_init(&grp->lock);
+		lo = (uint64_t)g * bpg;
+		hi = min_t(uint64_t, lo + bpg, sb->blocks_count);
+		grp->free_blocks = simplefs_bitmap_count(s, &sbinfo->dmap, lo, hi);
+		free_blocks += grp->free_blocks;
+		lo = (uint64_t)g * ipg;
+		hi = min_t(uint64_t, lo + ipg, sbinfo->imap.nbits);
+		if (lo < hi)
+			grp->free_inodes = simplefs_bitmap_count(s, &sbinfo->imap, lo, hi);
+		free_inodes += grp->free_inodes;
+	}
+	simplefs_count_dirs(s);
+
+	/* the per-group counts are authoritative, fix up the superblock */
+	sb->free_inodes = free_inodes;
+	sb->free_blocks = free_blocks;
+	sb->inodes_count = sb->max_inodes - free_inodes;
+
+	err = percpu_counter_init(&sbinfo->s_free_blocks, free_blocks, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbinfo->s_free_inodes, free_inodes, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbinfo->s_reserved_blocks, 0, GFP_KERNEL);
+	return err;
+}
+
+/* Called once the inode table is loaded, for the directory counts */
+int simplefs_load_bitmaps(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	int err;
+
+	err = simplefs_bitmap_load(s, &sbinfo->imap, sb->imap_block,
+			sb->imap_blocks, sb->max_inodes + 1);
+	if (err)
+		return err;
+	err = simplefs_bitmap_load(s, &sbinfo->dmap, sb->dmap_block,
+			sb->dmap_blocks, sb->blocks_count);
+	if (err)
+		return err;
+	return simplefs_load_groups(s);
+}
+
+void simplefs_put_bitmaps(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+
+	percpu_counter_destroy(&sbinfo->s_free_blocks);
+	percpu_counter_destroy(&sbinfo->s_free_inodes);
+	percpu_counter_destroy(&sbinfo->s_reserved_blocks);
+	free_percpu(sbinfo->s_group_hint);
+	sbinfo->s_group_hint = NULL;
+	kfree(sbinfo->s_groups);
+	sbinfo->s_groups = NULL;
+	simplefs_bitmap_put(&sbinfo->imap);
+	simplefs_bitmap_put(&sbinfo->dmap);
+}
@@ -0,0 +1,91 @@
+/*
+ * Metadata rates for bench.sh: create, stat or unlink <files> names in one
+ * directory from <threads> threads at once, each thread taking its own
+ * share of the names, and print the operations per second.
+ *
+ *   bench-meta create|stat|unlink <dir> <files> <threads>
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static const char *dir;
+static unsigned long files;
+static int nthreads;
+static char op;
+static pthread_barrier_t start;
+
+static void *run(void *arg)
+{
+	unsigned long t = (unsigned long)arg, i;
+	char name[4096];
+	struct stat st;
+	int fd, err = 0;
+
+	pthread_barrier_wait(&start);
+	for (i = t; i < files && !err; i += nthreads) {
+		snprintf(name, sizeof(name), "%s/f%08lu", dir, i);
+		switch (op) {
+		case 'c':
+			fd = open(name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			err = fd == -1 || close(fd);
+			break;
+		case 's':
+			err = stat(name, &st);
+			break;
+		case 'u':
+			err = unlink(name);
+			break;
+		}
+	}
+	if (err)
+		perror(name);
+	return (void *)(long)err;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	pthread_t *threads;
+	void *err;
+	double secs;
+	int i, failed = 0;
+
+	if (argc != 5 || !strchr("csu", argv[1][0]) ||
+	    !(files = strtoul(argv[3], NULL, 0)) || (nthreads = atoi(argv[4])) < 1) {
+		printf("Usage: bench-meta create|stat|unlink <dir> <files> <threads>\n");
+		return 2;
+	}
+	op = argv[1][0];
+	dir = argv[2];
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!threads)
+		return 1;
+	pthread_barrier_init(&start, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, run, (void *)(unsigned long)i)) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], &err);
+		failed |= err != NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(threads);
+	if (failed)
+		return 1;
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%.0f\n", files / secs);
+	return 0;
+}
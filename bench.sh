@@ -0,0 +1,227 @@
+#!/bin/bash
+#
+# make bench: run a fixed set of simplefs benchmarks in a throwaway VM.
+#
+# On the host this boots the running kernel (or BENCH_KERNEL) with
+# virtme-ng, sharing this directory, and reruns itself inside as root.
+# The guest loads ./simplefs.ko and runs the same matrix on a brd ramdisk
+# and on a loop device over a file in this directory, then writes all the
+# numbers to one JSON file, bench-<commit>.json unless BENCH_OUT says
+# otherwise.  fio, python3 and vng must be installed on the host; the
+# metadata rates come from bench-meta, the data rates from fio.
+#
+#   ./bench.sh                      run it (make bench)
+#   ./bench.sh -c old.json new.json compare two runs, exit 1 on a regression
+#
+# BENCH_SIZE (MiB, 2048), BENCH_RUNTIME (seconds per timed fio job, 10),
+# BENCH_CPUS (4), BENCH_MEMORY (BENCH_SIZE + 2G), BENCH_THRESHOLD (percent
+# counted as a regression, 5) and BENCH_NO_VM=1 (run here, as root, on a
+# machine that may be wrecked) tune it.
+
+set -e
+cd "$(dirname "$0")"
+
+SIZE=${BENCH_SIZE:-2048}
+RUNTIME=${BENCH_RUNTIME:-10}
+OUT=${BENCH_OUT:-bench-$(git rev-parse --short HEAD 2>/dev/null || echo local).json}
+MNT=/mnt/simplefs-bench
+
+# directory sizes and thread counts of the metadata runs
+DIR_SIZES="1000 10000 100000"
+THREADS="1 4"
+
+compare() {
+	python3 - "$1" "$2" "${BENCH_THRESHOLD:-5}" <<'EOF'
+import json, sys
+
+old, new = (json.load(open(f)) for f in sys.argv[1:3])
+limit = float(sys.argv[3])
+before = {(r["name"], r["device"]): r for r in old["results"]}
+worse = 0
+print("%-32s %-5s %14s %14s %8s" % ("case", "dev", old["git"], new["git"], "change"))
+for r in new["results"]:
+    o = before.get((r["name"], r["device"]))
+    if not o or not o["value"]:
+        continue
+    change = (r["value"] - o["value"]) * 100 / o["value"]
+    # times are better lower, rates better higher
+    if r["unit"] == "us":
+        change = -change
+    flag = " <-" if change < -limit else ""
+    worse += bool(flag)
+    print("%-32s %-5s %14.1f %14.1f %+7.1f%%%s" %
+          (r["name"], r["device"], o["value"], r["value"], change, flag))
+sys.exit(1 if worse else 0)
+EOF
+}
+
+if [ "$1" = "-c" ]; then
+	compare "$2" "$3"
+	exit
+fi
+
+if [ "$1" != "--guest" ] && [ -z "$BENCH_NO_VM" ]; then
+	for tool in vng fio python3; do
+		command -v $tool >/dev/null || { echo "bench: $tool not found" >&2; exit 1; }
+	done
+	exec vng --run ${BENCH_KERNEL:-} --user root --cpus ${BENCH_CPUS:-4} \
+		--memory ${BENCH_MEMORY:-$((SIZE + 2048))M} --rwdir "$PWD" \
+		--exec "BENCH_OUT='$OUT' BENCH_SIZE=$SIZE BENCH_RUNTIME=$RUNTIME $PWD/bench.sh --guest"
+fi
+
+WORK=$(mktemp -d)
+LOG=$WORK/results
+trap 'umount $MNT 2>/dev/null; [ -n "$LOOP" ] && losetup -d $LOOP; rm -rf $WORK $PWD/bench.img' EXIT
+
+now() {
+	date +%s%N
+}
+
+drop_caches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+}
+
+# record <name> <value> <unit>, or record <name> fio <fio json output file>
+record() {
+	printf '%s\t%s\t%s\t%s\n' "$1" "$DEVNAME" "$2" "$3" >> $LOG
+}
+
+fresh() {
+	umount $MNT 2>/dev/null || true
+	./mkfs-simplefs -s ${SIZE}M "$@" $DEV > /dev/null
+	mount -t simplefs $DEV $MNT
+}
+
+run_fio() {
+	local name=$1 out=$WORK/fio.$DEVNAME.${1//\//_}.json
+
+	shift
+	fio --output-format=json --output=$out --group_reporting "$@" --name=$name
+	record $name fio $out
+}
+
+# create, stat (cold) and unlink @files names in one directory from @jobs threads
+bench_meta() {
+	local files=$1 jobs=$2 op
+
+	fresh
+	mkdir $MNT/dir
+	for op in create stat unlink; do
+		drop_caches
+		record $op/$files/$jobs $(./bench-meta $op $MNT/dir $files $jobs) ops/s
+	done
+}
+
+# sequential and random I/O on one 1/4-filesystem file, buffered and direct
+bench_data() {
+	local direct mode size=$((SIZE / 4))M
+
+	for direct in 0 1; do
+		[ $direct = 1 ] && mode=direct || mode=buffered
+		fresh
+		run_fio seqwrite/$mode --filename=$MNT/data --size=$size --rw=write --bs=1M \
+			--direct=$direct --end_fsync=1
+		run_fio seqread/$mode --filename=$MNT/data --size=$size --rw=read --bs=1M \
+			--direct=$direct --invalidate=1
+		run_fio randread/$mode --filename=$MNT/data --size=$size --rw=randread --bs=4k \
+			--direct=$direct --numjobs=4 --time_based --runtime=$RUNTIME --invalidate=1
+		run_fio randwrite/$mode --filename=$MNT/data --size=$size --rw=randwrite --bs=4k \
+			--direct=$direct --numjobs=4 --time_based --runtime=$RUNTIME --end_fsync=1
+	done
+}
+
+# readdir alone, and readdir plus a stat of every name, cold; then mount time
+bench_tree() {
+	local files t
+
+	for files in $DIR_SIZES; do
+		fresh -d $WORK/tree/$files
+		umount $MNT
+		t=$(now)
+		mount -t simplefs $DEV $MNT
+		record mount/$files $(( ($(now) - t) / 1000 )) us
+		drop_caches
+		t=$(now)
+		ls -f $MNT/dir > /dev/null
+		record readdir/$files $(( files * 1000000000 / ($(now) - t) )) names/s
+		drop_caches
+		t=$(now)
+		find $MNT/dir -mindepth 1 -printf '%s\n' > /dev/null
+		record readdir+stat/$files $(( files * 1000000000 / ($(now) - t) )) names/s
+	done
+	umount $MNT
+	t=$(now)
+	./mkfs-simplefs -s ${SIZE}M $DEV > /dev/null
+	record mkfs $(( ($(now) - t) / 1000 )) us
+	t=$(now)
+	mount -t simplefs $DEV $MNT
+	record mount/empty $(( ($(now) - t) / 1000 )) us
+}
+
+run_matrix() {
+	local files jobs
+
+	for files in $DIR_SIZES; do
+		for jobs in $THREADS; do
+			bench_meta $files $jobs
+		done
+	done
+	bench_data
+	bench_tree
+	umount $MNT
+}
+
+summarize() {
+	python3 - $LOG "$(git rev-parse --short HEAD 2>/dev/null || echo local)" \
+		"$(uname -r)" $SIZE <<'EOF'
+import json, sys, time
+
+log, rev, kernel, size = sys.argv[1:]
+results = []
+for line in open(log):
+    name, dev, value, unit = line.rstrip("\n").split("\t")
+    r = {"name": name, "device": dev}
+    if value == "fio":
+        job = json.load(open(unit))["jobs"][0]
+        ops = [job[d] for d in ("read", "write") if job[d]["total_ios"]]
+        r["value"] = sum(d["iops"] for d in ops)
+        r["unit"] = "ops/s"
+        r["bw_kib"] = sum(d["bw"] for d in ops)
+        r["lat_mean_ns"] = max(d["lat_ns"]["mean"] for d in ops) if ops else 0
+        r["clat_p99_ns"] = max(d["clat_ns"].get("percentile", {}).get("99.000000", 0)
+                               for d in ops) if ops else 0
+    else:
+        r["value"] = float(value)
+        r["unit"] = unit
+    results.append(r)
+json.dump({"git": rev, "kernel": kernel, "size_mib": int(size),
+           "date": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+           "results": results}, sys.stdout, indent=1)
+print()
+EOF
+}
+
+# one directory of n empty files per size, for mkfs -d
+for files in $DIR_SIZES; do
+	mkdir -p $WORK/tree/$files/dir
+	(cd $WORK/tree/$files/dir && seq -f 'f%08g' $files | xargs touch)
+done
+
+modprobe jbd2
+rmmod simplefs 2>/dev/null || true
+insmod ./simplefs.ko
+mkdir -p $MNT
+
+modprobe brd rd_nr=1 rd_size=$((SIZE * 1024))
+DEV=/dev/ram0 DEVNAME=brd
+run_matrix
+rmmod brd
+
+truncate -s ${SIZE}M $PWD/bench.img
+LOOP=$(losetup -f --show --direct-io=on $PWD/bench.img)
+DEV=$LOOP DEVNAME=loop
+run_matrix
+
+summarize > $OUT
+echo "bench: results in $OUT"
@@ -3,113 +3,177 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include "simple.h"
-
-static int simplefs_add_entry(struct inode *dir, const struct qstr *child, int ino);
-static struct buffer_head *simplefs_find_entry(struct inode *dir,
-		const struct qstr *child,
-		struct simplefs_dir_record **res_dir);
-static int simplefs_delete_entry(struct buffer_head *bh, struct inode *dir,
-		struct simplefs_dir_record *drecord);
+#include "trace.h"
+
+/*
+ * ls -l, du and rsync stat every name right after reading a directory.
+ * Lookups landing in a directory within SIMPLEFS_DIRPLUS_WINDOW of its
+ * last readdir are counted per filesystem, and every new scan halves the
+ * count.  While it stays above SIMPLEFS_DIRPLUS_HITS, readdir starts the
+ * reads that simplefs_iget() will need for the names it returns, in one
+ * plugged batch per leaf; -o dirplus always does, and loads the inodes
+ * into the inode cache as well.
+ */
+#define SIMPLEFS_DIRPLUS_WINDOW	HZ
+#define SIMPLEFS_DIRPLUS_HITS	16
 
 static int simplefs_readdir(struct file *f, struct dir_context *ctx)
 {
 	struct inode *dir = file_inode(f);
+	struct simplefs_sb_info *sbi = simplefs_sb(dir->i_sb);
+	int plus = 0, hits = atomic_read(&sbi->s_dirplus_hits);
+	loff_t pos = ctx->pos;
+	int ret;
+
+	if (!ctx->pos) {
+		hits /= 2;
+		atomic_set(&sbi->s_dirplus_hits, hits);
+	}
+	if (sbi->s_mount_opt & SIMPLEFS_MOUNT_DIRPLUS)
+		plus = SIMPLEFS_DIRPLUS_ICACHE;
+	else if (hits >= SIMPLEFS_DIRPLUS_HITS)
+		plus = SIMPLEFS_DIRPLUS_RA;
+	WRITE_ONCE(simplefs_i(dir)->i_readdir_time, jiffies);
+	ret = simplefs_dir_iterate(f, ctx, plus);
+	trace_simplefs_readdir(dir, pos, ctx->pos, plus, ret);
+	return ret;
+}
+
+const struct file_operations simplefs_dir_operations = {
+	.llseek         = simplefs_dir_llseek,
+	.read           = generic_read_dir,
+	.iterate_shared = simplefs_readdir,
+	.fsync          = simplefs_fsync,
+};
+
+/*
+ * A symlink target shorter than SIMPLEFS_INLINE_SIZE lives in the inode,
+ * NUL included, and i_link points at the in-core copy: simple_get_link()
+ * resolves it without any I/O and without leaving RCU path walk.  Longer
+ * targets take the first block, read and written through the buffer cache
+ * like directory blocks.  i_size is the length of the target.
+ */
+static const char *simplefs_get_link(struct dentry *dentry, struct inode *inode,
+		struct delayed_call *done)
+{
 	struct buffer_head *bh;
-	struct simplefs_dir_record *drecord;
-	struct simplefs_inode_info *sinfo = simplefs_i(dir);
-	int i;
-
-	if (ctx->pos & (sizeof(struct simplefs_dir_record) - 1)) {
-		pr_err("Bad f_pos=%08lx for %s:%08lx\n",
-				(unsigned long)ctx->pos,
-				dir->i_sb->s_id, dir->i_ino);
-		return -EINVAL;
+	unsigned int len = 1;
+	sector_t phys;
+	char *link;
+	int err;
+
+	if (!dentry)
+		return ERR_PTR(-ECHILD);
+	if (!inode->i_size || inode->i_size > inode->i_sb->s_blocksize)
+		return ERR_PTR(-EIO);
+
+	err = simplefs_map_blocks(inode, 0, &len, &phys, 0);
+	if (err < 0)
+		return ERR_PTR(err);
+	if (!phys)
+		return ERR_PTR(-EIO);
+	bh = sb_bread(inode->i_sb, phys);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	link = kmalloc(inode->i_size + 1, GFP_KERNEL);
+	if (!link) {
+		brelse(bh);
+		return ERR_PTR(-ENOMEM);
 	}
+	memcpy(link, bh->b_data, inode->i_size);
+	link[inode->i_size] = '\0';
+	brelse(bh);
+	set_delayed_call(done, kfree_link, link);
+	return link;
+}
 
-	bh = sb_bread(dir->i_sb, sinfo->data_block_number);
+static int simplefs_write_link(struct inode *inode, const char *symname)
+{
+	unsigned int len = 1, size = strlen(symname);
+	struct buffer_head *bh;
+	sector_t phys;
+	int err;
+
+	if (size >= inode->i_sb->s_blocksize)
+		return -ENAMETOOLONG;
+	if (size < SIMPLEFS_INLINE_SIZE) {
+		struct simplefs_inode_info *sinfo = simplefs_i(inode);
+
+		memset(sinfo->i_inline, 0, SIMPLEFS_INLINE_SIZE);
+		memcpy(sinfo->i_inline, symname, size);
+		sinfo->i_flags |= SIMPLEFS_INLINE_DATA_FL;
+		inode->i_link = sinfo->i_inline;
+		inode->i_op = &simplefs_fast_symlink_inops;
+		inode->i_size = size;
+		return 0;
+	}
+	err = simplefs_map_blocks(inode, 0, &len, &phys, SIMPLEFS_MAP_CREATE);
+	if (err < 0)
+		return err;
+
+	bh = sb_getblk(inode->i_sb, phys);
 	if (!bh)
 		return -EIO;
-
-	while (ctx->pos < dir->i_size) {
-		drecord = (struct simplefs_dir_record *)bh->b_data;
-		for (i = 0; i < sinfo->dir_children_count; i++)
-		{
-			int size = strnlen(drecord->filename, SIMPLEFS_FILENAME_MAXLEN);
-			dir_emit(ctx, drecord->filename, size, drecord->inode_no, DT_UNKNOWN);
-			ctx->pos += sizeof(struct simplefs_dir_record);
-			drecord++;
-		}
+	lock_buffer(bh);
+	err = simplefs_get_create_access(bh);
+	if (!err) {
+		memset(bh->b_data, 0, bh->b_size);
+		memcpy(bh->b_data, symname, size);
+		set_buffer_uptodate(bh);
+	}
+	unlock_buffer(bh);
+	if (!err) {
+		simplefs_dirty_metadata(bh, inode);
+		inode->i_size = size;
 	}
 	brelse(bh);
-
-	return 0;
+	return err;
 }
 
-const struct file_operations simplefs_dir_operations = {
-	.llseek         = generic_file_llseek,
-	.read           = generic_read_dir,
-	.iterate_shared = simplefs_readdir,
-	.fsync          = generic_file_fsync,
+const struct inode_operations simplefs_symlink_inops = {
+	.get_link       = simplefs_get_link,
 };
 
-const struct inode_operations simplefs_symlink_inops = {
-	.get_link       = page_get_link,
-}; 
+const struct inode_operations simplefs_fast_symlink_inops = {
+	.get_link       = simple_get_link,
+};
 
 static int simplefs_create_inode(struct inode *dir, struct dentry *dentry, umode_t mode, const void *d)
 {
-	int err, i;
+	int err;
 	struct inode *inode;
 	struct super_block *s = dir->i_sb;
-	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
-	struct simplefs_super_block *sb = sbinfo->sb;
-	uint64_t data_block_number = 0;
-	unsigned long ino = 0;
+	unsigned long ino;
 	const char *symname = d;
+	handle_t *handle;
 
 	inode = new_inode(s);
 	if (!inode)
 		return -ENOMEM;
-	mutex_lock(&sbinfo->simplefs_lock);
-	for (i = 0; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-	{
-		if (sb->imap & (1 << i)) {
-			ino = i + SIMPLEFS_ROOTDIR_INODE_NUMBER;
-			break;
-		}
+	handle = simplefs_journal_start(s, SIMPLEFS_DIROP_CREDITS);
+	if (IS_ERR(handle)) {
+		iput(inode);
+		return PTR_ERR(handle);
 	}
+	ino = simplefs_new_inode_no(s, dir, mode);
 	if (!ino) {
 		err = -ENOSPC;
 		goto out;
 	}
-	sb->imap &= ~(1 << (ino - SIMPLEFS_ROOTDIR_INODE_NUMBER));
-	sb->inodes_count++;
-	for (i = 0; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-	{
-		if (sb->dmap & (1 << i)) {
-			data_block_number = i + SIMPLEFS_START_DATABLOCK_NUMBER;
-			break;
-		}
-	}
-	if (!data_block_number) {
-		err = -ENOSPC;
-		goto out;
-	}
-	sb->dmap &= ~(1 << (data_block_number - SIMPLEFS_START_DATABLOCK_NUMBER));
-	mark_buffer_dirty(sbinfo->sbh);
-	sync_dirty_buffer(sbinfo->sbh);
 
 	inode_init_owner(inode, dir, mode);
 	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
 	inode->i_blocks = 0;
-	if (IS_DAX(inode))
-		inode->i_mapping->a_ops = &simplefs_dax_aops;
-	else
-		inode->i_mapping->a_ops = &simplefs_aops;
+	/* regular files start out inline, unless DAX is to map their blocks */
+	if (S_ISREG(mode) && !(simplefs_sb(s)->s_mount_opt & SIMPLEFS_MOUNT_DAX)) {
+		simplefs_i(inode)->i_flags |= SIMPLEFS_INLINE_DATA_FL;
+		memset(simplefs_i(inode)->i_inline, 0, SIMPLEFS_INLINE_SIZE);
+	}
+	simplefs_set_aops(inode);
 	inode->i_ino = ino;
 	inode->i_size = 0;
-	simplefs_i(inode)->data_block_number = data_block_number;
 	simplefs_i(inode)->dir_children_count = 0;
 
 	if (S_ISDIR(inode->i_mode)) {
@@ -120,8 +184,7 @@ static int simplefs_create_inode(struct inode *dir, struct dentry *dentry, umode
 		inode->i_fop = &simplefs_file_operations;
 	} else if (S_ISLNK(inode->i_mode)) {
 		inode->i_op = &simplefs_symlink_inops;
-		inode_nohighmem(inode);
-		err = page_symlink(inode, symname, strlen(symname) + 1);
+		err = simplefs_write_link(inode, symname);
 		if (err) {
 			inode_dec_link_count(inode);
 			goto out;
@@ -131,17 +194,16 @@ static int simplefs_create_inode(struct inode *dir, struct dentry *dentry, umode
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 
-	err = simplefs_add_entry(dir, &dentry->d_name, inode->i_ino);
+	err = simplefs_add_entry(dir, &dentry->d_name, inode);
 	if (err) {
 		inode_dec_link_count(inode);
 		goto out;
 	}
-	mutex_unlock(&sbinfo->simplefs_lock);
 	d_instantiate(dentry, inode);
 
-	return 0;
+	return simplefs_journal_stop(handle);
 out:
-	mutex_unlock(&sbinfo->simplefs_lock);
+	simplefs_journal_stop(handle);
 	iput(inode);
 	return err;
 }
@@ -157,11 +219,13 @@ static struct dentry *simplefs_lookup(struct inode *dir, struct dentry *dentry,
 	struct inode *inode = NULL;
 	struct buffer_head *bh;
 	struct simplefs_dir_record *drecord;
-	struct simplefs_sb_info *sbinfo = simplefs_sb(dir->i_sb);
+	unsigned long read = READ_ONCE(simplefs_i(dir)->i_readdir_time);
 
-	mutex_lock(&sbinfo->simplefs_lock);
+	/* the VFS holds dir->i_rwsem, shared, so lookups run in parallel */
 	if (dentry->d_name.len > SIMPLEFS_FILENAME_MAXLEN)
 		return ERR_PTR(-ENAMETOOLONG);
+	if (read && time_before(jiffies, read + SIMPLEFS_DIRPLUS_WINDOW))
+		atomic_inc(&simplefs_sb(dir->i_sb)->s_dirplus_hits);
 
 	bh = simplefs_find_entry(dir, &dentry->d_name, &drecord);
 	if (bh) {
@@ -169,20 +233,21 @@ static struct dentry *simplefs_lookup(struct inode *dir, struct dentry *dentry,
 		brelse(bh);
 		inode = simplefs_iget(dir->i_sb, ino);
 	}
-	mutex_unlock(&sbinfo->simplefs_lock);
 	return d_splice_alias(inode, dentry);
 }
 
 static int simplefs_link(struct dentry *old, struct inode *dir, struct dentry *new)
 {
 	struct inode *inode = d_inode(old);
-	struct simplefs_sb_info *sbinfo = simplefs_sb(inode->i_sb);
+	handle_t *handle;
 	int err;
 
-	mutex_lock(&sbinfo->simplefs_lock);
-	err = simplefs_add_entry(dir, &new->d_name, inode->i_ino);
+	handle = simplefs_journal_start(dir->i_sb, SIMPLEFS_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	err = simplefs_add_entry(dir, &new->d_name, inode);
 	if (err) {
-		mutex_unlock(&sbinfo->simplefs_lock);
+		simplefs_journal_stop(handle);
 		return err;
 	}
 	inc_nlink(inode);
@@ -190,32 +255,20 @@ static int simplefs_link(struct dentry *old, struct inode *dir, struct dentry *n
 	mark_inode_dirty(inode);
 	ihold(inode);
 	d_instantiate(new, inode);
-	mutex_unlock(&sbinfo->simplefs_lock);
-	return 0;
+	return simplefs_journal_stop(handle);
 }
 
 static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	int error = -ENOENT;
 	struct inode *inode = d_inode(dentry);
-	struct simplefs_inode_info *sinfo = simplefs_i(inode);
-	uint64_t data_block_number = sinfo->data_block_number;
 	struct buffer_head *bh;
 	struct simplefs_dir_record *drecord;
-	struct super_block *s = inode->i_sb;
-	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
-	struct simplefs_super_block *sb = sbinfo->sb;
-
-	mutex_lock(&sbinfo->simplefs_lock);
-
-	if (inode->i_nlink == 1) {
-		sb->inodes_count--;
-		sb->imap |= (1 << (inode->i_ino - SIMPLEFS_ROOTDIR_INODE_NUMBER));
-		sb->dmap |= (1 << (data_block_number - SIMPLEFS_START_DATABLOCK_NUMBER));
-		mark_buffer_dirty(sbinfo->sbh);
-		sync_dirty_buffer(sbinfo->sbh);
-	}
+	handle_t *handle;
 
+	handle = simplefs_journal_start(dir->i_sb, SIMPLEFS_DIROP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
 	bh = simplefs_find_entry(dir, &dentry->d_name, &drecord);
 	if (!bh || drecord->inode_no != inode->i_ino)
 		goto out;
@@ -231,7 +284,6 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
 	if (error)
 		goto out;
 
-	mark_buffer_dirty_inode(bh, dir);
 	dir->i_ctime = dir->i_mtime = current_time(dir);
 	mark_inode_dirty(dir);
 	inode->i_ctime = dir->i_ctime;
@@ -239,7 +291,7 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
 	error = 0;
 out:
 	brelse(bh);
-	mutex_unlock(&sbinfo->simplefs_lock);
+	simplefs_journal_stop(handle);
 	return error;
 }
 
@@ -273,146 +325,3 @@ const struct inode_operations simplefs_dir_inops = {
 	.rmdir			= simplefs_rmdir,
 	.symlink		= simplefs_symlink,
 };
-
-static int simplefs_add_entry(struct inode *dir, const struct qstr *child, int ino)
-{
-	const unsigned char *name = child->name;
-	int i, namelen = child->len, err = 0;
-	struct buffer_head *ibh, *dbh;
-	struct simplefs_dir_record *drecord;
-	struct simplefs_inode_info *sinfo = simplefs_i(dir);
-	struct simplefs_sb_info *sbinfo = simplefs_sb(dir->i_sb);
-	struct simplefs_super_block *sb = sbinfo->sb;
-	struct simplefs_inode *sinode;
-	uint64_t data_block_number = sinfo->data_block_number;
-	uint64_t dir_children_count = sinfo->dir_children_count;
-
-	if (!namelen)
-		return -ENOENT;
-	if (namelen > SIMPLEFS_FILENAME_MAXLEN)
-		return -ENAMETOOLONG;
-
-	if (!data_block_number) {
-		for (i = 0; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-		{
-			if (sb->dmap & (1 << i)) {
-				data_block_number = i + SIMPLEFS_START_DATABLOCK_NUMBER;
-				break;
-			}
-		}
-		if (!data_block_number) {
-			err = -ENOSPC;
-			goto out;
-		}
-	}
-	sb->dmap &= ~(1 << (data_block_number - SIMPLEFS_START_DATABLOCK_NUMBER));
-	mark_buffer_dirty(sbinfo->sbh);
-	sync_dirty_buffer(sbinfo->sbh);
-
-	ibh = sb_bread(dir->i_sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	if (!ibh) {
-		err = -EIO;
-		goto out;
-	}
-	sinode = (struct simplefs_inode *)(ibh->b_data);
-	sinode += (dir->i_ino - SIMPLEFS_ROOTDIR_INODE_NUMBER);
-	sinode->data_block_number = data_block_number;
-	sinode->dir_children_count++;
-	sinfo->dir_children_count = sinode->dir_children_count;
-	dir->i_size = sinfo->dir_children_count * sizeof(struct simplefs_dir_record);
-	mark_inode_dirty(dir);
-	mark_buffer_dirty(ibh);
-	sync_dirty_buffer(ibh);
-	brelse(ibh);
-
-	dbh = sb_bread(dir->i_sb, data_block_number);
-	if (!dbh) {
-		err = -EIO;
-		goto out;
-	}
-	drecord = (struct simplefs_dir_record *)(dbh->b_data);
-
-	drecord += dir_children_count;
-	drecord->inode_no = ino;
-	memcpy(drecord->filename, name, namelen);
-
-	mark_buffer_dirty(dbh);
-	sync_dirty_buffer(dbh);
-	brelse(dbh);
-out:
-	return err;
-}
-
-static inline int simplefs_namecmp(int len, const unsigned char *name,
-		const char *buffer)
-{
-	if ((len < SIMPLEFS_FILENAME_MAXLEN) && buffer[len])
-		return 0;
-	return !memcmp(name, buffer, len);
-}
-
-static struct buffer_head *simplefs_find_entry(struct inode *dir,
-		const struct qstr *child,
-		struct simplefs_dir_record **res_dir)
-{
-	struct buffer_head *bh = NULL;
-	struct simplefs_dir_record *drecord;
-	struct simplefs_inode_info *sinfo = simplefs_i(dir);
-	const unsigned char *name = child->name;
-	int namelen = child->len;
-	int i;
-
-	*res_dir = NULL;
-	if (namelen > SIMPLEFS_FILENAME_MAXLEN)
-		return NULL;
-
-	bh = sb_bread(dir->i_sb, sinfo->data_block_number);
-	drecord = (struct simplefs_dir_record *)(bh->b_data);
-
-	for (i = 0; i < dir->i_size; i++)
-	{
-		if ((strlen(drecord->filename) == namelen) && !memcmp(drecord->filename, name, namelen)) {
-			*res_dir = drecord;
-			return bh;
-		}
-		drecord++;
-	}
-
-	brelse(bh);
-	return NULL;
-}
-
-static int simplefs_delete_entry(struct buffer_head *bh, struct inode *dir,
-		struct simplefs_dir_record *drecord)
-{
-	int size = 0;
-	struct simplefs_inode_info *sinfo = simplefs_i(dir);
-	struct simplefs_inode *sinode;
-	struct buffer_head *ibh;
-	struct simplefs_dir_record *start_drecord;
-
-	start_drecord = (struct simplefs_dir_record *)(bh->b_data);
-	size = (sinfo->dir_children_count - 1) * sizeof(struct simplefs_dir_record) - \
-	       (drecord - start_drecord);
-	memmove(drecord, drecord + 1, size);
-	memset(start_drecord + sinfo->dir_children_count - 1, 0, sizeof(struct simplefs_dir_record));
-	dir->i_ctime = dir->i_mtime = current_time(dir);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-
-	ibh = sb_bread(dir->i_sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	if (!ibh)
-		return -EIO;
-	sinode = (struct simplefs_inode *)(ibh->b_data);
-	sinode += (dir->i_ino - SIMPLEFS_ROOTDIR_INODE_NUMBER);
-	sinode->dir_children_count--;
-	sinfo->dir_children_count = sinode->dir_children_count;
-
-	dir->i_size = sinfo->dir_children_count * sizeof(struct simplefs_dir_record);
-	mark_inode_dirty(dir);
-	mark_buffer_dirty(ibh);
-	sync_dirty_buffer(ibh);
-	brelse(ibh);
-
-	return 0;
-}
@@ -0,0 +1,725 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include "simple.h"
+#include "trace.h"
+
+/*
+ * Every inode maps its logical blocks through a sorted array of extents.
+ * Up to SIMPLEFS_INODE_EXTENTS of them live in the on-disk inode; past
+ * that the whole array is moved to a dedicated extent block.  The array is
+ * cached in simplefs_inode_info and protected by i_extent_sem.
+ */
+
+/* Index of the last extent starting at or before @iblock, -1 if none */
+static int simplefs_ext_search(struct simplefs_inode_info *sinfo, sector_t iblock)
+{
+	int lo = 0, hi = (int)sinfo->i_extent_count - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (sinfo->i_extent[mid].ee_block <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+/*
+ * Look up @iblock.  If it is mapped, return 1, or SIMPLEFS_MAP_UNWRITTEN
+ * for an unwritten extent, with *phys set and *len trimmed to the rest of
+ * the extent.  Otherwise return 0 with *len trimmed to the size of the hole.
+ */
+static int simplefs_ext_lookup(struct simplefs_inode_info *sinfo, sector_t iblock,
+		unsigned int *len, sector_t *phys)
+{
+	struct simplefs_extent *ext;
+	int i = simplefs_ext_search(sinfo, iblock);
+
+	if (i >= 0) {
+		ext = &sinfo->i_extent[i];
+		if (iblock < (sector_t)ext->ee_block + simplefs_ext_len(ext)) {
+			*phys = ext->ee_start + (iblock - ext->ee_block);
+			*len = min_t(sector_t, *len,
+				     ext->ee_block + simplefs_ext_len(ext) - iblock);
+			return simplefs_ext_unwritten(ext) ? SIMPLEFS_MAP_UNWRITTEN : 1;
+		}
+	}
+	if (i + 1 < (int)sinfo->i_extent_count) {
+		ext = &sinfo->i_extent[i + 1];
+		*len = min_t(sector_t, *len, ext->ee_block - iblock);
+	}
+	*phys = 0;
+	return 0;
+}
+
+/* Pick the physical block that would extend the preceding extent */
+static sector_t simplefs_ext_goal(struct simplefs_inode_info *sinfo, sector_t iblock)
+{
+	struct simplefs_extent *ext;
+	int i = simplefs_ext_search(sinfo, iblock);
+
+	if (i < 0)
+		return 0;
+	ext = &sinfo->i_extent[i];
+	return ext->ee_start + (iblock - ext->ee_block);
+}
+
+/* Move the extent array out of the inode into a freshly allocated block */
+static int simplefs_ext_spill(struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_extent *array;
+	struct buffer_head *bh;
+	unsigned int count = 1;
+	sector_t goal, blk;
+	int err;
+
+	array = kcalloc(SIMPLEFS_EXTENTS_PER_BLOCK, sizeof(struct simplefs_extent), GFP_NOFS);
+	if (!array)
+		return -ENOMEM;
+
+	goal = sinfo->i_extent[0].ee_start;
+	err = simplefs_new_blocks(sb, goal, &count, &blk, 0);
+	if (err) {
+		kfree(array);
+		return err;
+	}
+
+	bh = sb_getblk(sb, blk);
+	if (!bh) {
+		simplefs_free_blocks(sb, blk, 1);
+		kfree(array);
+		return -EIO;
+	}
+	lock_buffer(bh);
+	err = simplefs_get_create_access(bh);
+	if (err) {
+		unlock_buffer(bh);
+		brelse(bh);
+		simplefs_free_blocks(sb, blk, 1);
+		kfree(array);
+		return err;
+	}
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	simplefs_dirty_metadata(bh, inode);
+	brelse(bh);
+
+	memcpy(array, sinfo->i_extent, sinfo->i_extent_count * sizeof(struct simplefs_extent));
+	sinfo->i_extent = array;
+	sinfo->i_extent_block = blk;
+	inode->i_blocks += sb->s_blocksize >> 9;
+	return 0;
+}
+
+/* Can @b be folded into @a, which it directly follows? */
+static bool simplefs_ext_mergeable(const struct simplefs_extent *a,
+		const struct simplefs_extent *b)
+{
+	uint32_t len = simplefs_ext_len(a);
+
+	return a->ee_block + len == b->ee_block && a->ee_start + len == b->ee_start &&
+	       simplefs_ext_unwritten(a) == simplefs_ext_unwritten(b) &&
+	       (uint64_t)len + simplefs_ext_len(b) <= SIMPLEFS_EXT_MAX_LEN;
+}
+
+/* Fold extent @i + 1 into extent @i */
+static void simplefs_ext_merge(struct simplefs_inode_info *sinfo, int i)
+{
+	struct simplefs_extent *ext = sinfo->i_extent;
+
+	ext[i].ee_len += simplefs_ext_len(&ext[i + 1]);
+	memmove(&ext[i + 1], &ext[i + 2],
+		(sinfo->i_extent_count - i - 2) * sizeof(struct simplefs_extent));
+	sinfo->i_extent_count--;
+}
+
+/* Make sure the array can take one more extent */
+static int simplefs_ext_room(struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+
+	if (!sinfo->i_extent_block && sinfo->i_extent_count == SIMPLEFS_INODE_EXTENTS)
+		return simplefs_ext_spill(inode);
+	if (sinfo->i_extent_count == SIMPLEFS_EXTENTS_PER_BLOCK)
+		return -EFBIG;
+	return 0;
+}
+
+/* Record a new mapping, merging it with its neighbours when contiguous */
+static int simplefs_ext_insert(struct inode *inode, uint32_t lblk,
+		uint64_t pblk, uint32_t len, bool unwritten)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_extent *ext = sinfo->i_extent;
+	struct simplefs_extent new = {
+		.ee_block = lblk,
+		.ee_len = len | (unwritten ? SIMPLEFS_EXT_UNWRITTEN : 0),
+		.ee_start = pblk,
+	};
+	int i = simplefs_ext_search(sinfo, lblk);
+	int err;
+
+	if (i >= 0 && simplefs_ext_mergeable(&ext[i], &new)) {
+		ext[i].ee_len += len;
+		if (i + 1 < (int)sinfo->i_extent_count &&
+		    simplefs_ext_mergeable(&ext[i], &ext[i + 1]))
+			simplefs_ext_merge(sinfo, i);
+		return 0;
+	}
+	if (i + 1 < (int)sinfo->i_extent_count &&
+	    simplefs_ext_mergeable(&new, &ext[i + 1])) {
+		ext[i + 1].ee_block = lblk;
+		ext[i + 1].ee_start = pblk;
+		ext[i + 1].ee_len += len;
+		return 0;
+	}
+
+	err = simplefs_ext_room(inode);
+	if (err)
+		return err;
+	ext = sinfo->i_extent;
+	memmove(&ext[i + 2], &ext[i + 1],
+		(sinfo->i_extent_count - i - 1) * sizeof(struct simplefs_extent));
+	ext[i + 1] = new;
+	sinfo->i_extent_count++;
+	return 0;
+}
+
+/* Split extent @i at @at, which must lie strictly inside it */
+static int simplefs_ext_split(struct inode *inode, int i, sector_t at)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_extent *ext;
+	uint32_t off;
+	int err;
+
+	err = simplefs_ext_room(inode);
+	if (err)
+		return err;
+	ext = sinfo->i_extent;
+	off = at - ext[i].ee_block;
+	memmove(&ext[i + 2], &ext[i + 1],
+		(sinfo->i_extent_count - i - 1) * sizeof(struct simplefs_extent));
+	ext[i + 1].ee_block = at;
+	ext[i + 1].ee_start = ext[i].ee_start + off;
+	ext[i + 1].ee_len = ext[i].ee_len - off;
+	ext[i].ee_len = (ext[i].ee_len & SIMPLEFS_EXT_UNWRITTEN) | off;
+	sinfo->i_extent_count++;
+	return 0;
+}
+
+/*
+ * Turn the extents covering @len blocks from @iblock unwritten, or back
+ * into written ones, splitting them at the edges of the range.  Holes in
+ * the range are left alone.  Called with i_extent_sem held for writing.
+ */
+static int simplefs_ext_set(struct inode *inode, sector_t iblock, sector_t len,
+		bool unwritten)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	sector_t end = iblock + len;
+	struct simplefs_extent *ext;
+	int i, err = 0;
+
+	for (i = max(simplefs_ext_search(sinfo, iblock), 0);
+	     i < (int)sinfo->i_extent_count; i++) {
+		ext = &sinfo->i_extent[i];
+		if (ext->ee_block >= end)
+			break;
+		if (ext->ee_block + simplefs_ext_len(ext) <= iblock ||
+		    simplefs_ext_unwritten(ext) == unwritten)
+			continue;
+		if (ext->ee_block < iblock) {
+			/* the next round gets the part inside the range */
+			err = simplefs_ext_split(inode, i, iblock);
+			if (err)
+				break;
+			continue;
+		}
+		if (ext->ee_block + simplefs_ext_len(ext) > end) {
+			err = simplefs_ext_split(inode, i, end);
+			if (err)
+				break;
+			ext = &sinfo->i_extent[i];
+		}
+		ext->ee_len = simplefs_ext_len(ext) | (unwritten ? SIMPLEFS_EXT_UNWRITTEN : 0);
+	}
+
+	for (i = 0; i + 1 < (int)sinfo->i_extent_count; ) {
+		if (simplefs_ext_mergeable(&sinfo->i_extent[i], &sinfo->i_extent[i + 1]))
+			simplefs_ext_merge(sinfo, i);
+		else
+			i++;
+	}
+	return err;
+}
+
+int simplefs_ext_convert(struct inode *inode, sector_t iblock, sector_t len,
+		bool unwritten)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	handle_t *handle;
+	int err;
+
+	handle = simplefs_journal_start(inode->i_sb, SIMPLEFS_MAP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	down_write(&sinfo->i_extent_sem);
+	err = simplefs_ext_set(inode, iblock, len, unwritten);
+	up_write(&sinfo->i_extent_sem);
+	mark_inode_dirty(inode);
+	simplefs_journal_stop(handle);
+	return err;
+}
+
+/* How many of @len blocks from @iblock hold a delayed allocation reservation */
+static unsigned int simplefs_da_reserved(struct inode *inode, sector_t iblock,
+		unsigned int len)
+{
+	struct xarray *xa = &simplefs_i(inode)->i_delalloc;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (xa_load(xa, iblock + i))
+			n++;
+	}
+	return n;
+}
+
+/*
+ * Map up to *len blocks of @inode starting at @iblock.  On return *phys is
+ * the first physical block (0 for a hole) and *len the length of the run;
+ * SIMPLEFS_MAP_UNWRITTEN says the run is unwritten.  With @create set a
+ * hole is filled with a contiguous allocation of up to *len blocks and
+ * SIMPLEFS_MAP_NEW is returned; SIMPLEFS_MAP_PREALLOC makes the new extent
+ * unwritten, except under DAX where the blocks are zeroed instead.
+ * SIMPLEFS_MAP_DELALLOC draws on the reservations of the range and gives
+ * back those of the blocks it got.  The allocation runs in a journal
+ * handle of its own, or joins the caller's.
+ */
+int simplefs_map_blocks(struct inode *inode, sector_t iblock,
+		unsigned int *len, sector_t *phys, int create)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	unsigned int count;
+	sector_t start, goal;
+	handle_t *handle;
+	int err;
+
+	down_read(&sinfo->i_extent_sem);
+	err = simplefs_ext_lookup(sinfo, iblock, len, phys);
+	up_read(&sinfo->i_extent_sem);
+	if (!create || (err && !(err == SIMPLEFS_MAP_UNWRITTEN && IS_DAX(inode)))) {
+		err = err == SIMPLEFS_MAP_UNWRITTEN ? err : 0;
+		trace_simplefs_map_blocks(inode, iblock, *len, *phys, create, err);
+		return err;
+	}
+
+	if (iblock + *len > U32_MAX)
+		return -EFBIG;
+
+	handle = simplefs_journal_start(sb, SIMPLEFS_MAP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	down_write(&sinfo->i_extent_sem);
+	err = simplefs_ext_lookup(sinfo, iblock, len, phys);
+	if (err == SIMPLEFS_MAP_UNWRITTEN && IS_DAX(inode)) {
+		/* DAX stores go straight to the blocks, which must hold zeros */
+		err = sb_issue_zeroout(sb, *phys, *len, GFP_NOFS);
+		if (!err)
+			err = simplefs_ext_set(inode, iblock, *len, false);
+		if (!err)
+			err = SIMPLEFS_MAP_NEW;
+		goto out;
+	}
+	if (err) {
+		if (err != SIMPLEFS_MAP_UNWRITTEN)
+			err = 0;
+		goto out;
+	}
+
+	count = *len;
+	goal = simplefs_ext_goal(sinfo, iblock);
+	if (!goal) {
+		goal = max_t(sector_t, simplefs_data_goal(inode),
+			     simplefs_sb(sb)->sb->data_block);
+		if (IS_DAX(inode))
+			goal = round_up(goal, SIMPLEFS_DAX_ALIGN) +
+				(iblock & (SIMPLEFS_DAX_ALIGN - 1));
+	}
+	err = simplefs_new_blocks(sb, goal, &count, &start,
+			create == SIMPLEFS_MAP_DELALLOC ?
+			simplefs_da_reserved(inode, iblock, count) : 0);
+	if (err)
+		goto out;
+
+	/*
+	 * DAX has no page cache to zero the blocks through; do it before
+	 * anyone can look the new mapping up.
+	 */
+	if (IS_DAX(inode)) {
+		err = sb_issue_zeroout(sb, start, count, GFP_NOFS);
+		if (err) {
+			simplefs_free_blocks(sb, start, count);
+			goto out;
+		}
+	}
+	err = simplefs_ext_insert(inode, iblock, start, count,
+			create == SIMPLEFS_MAP_PREALLOC && !IS_DAX(inode));
+	if (err) {
+		simplefs_free_blocks(sb, start, count);
+		goto out;
+	}
+	inode->i_blocks += (blkcnt_t)count << (inode->i_blkbits - 9);
+	if (create == SIMPLEFS_MAP_DELALLOC)
+		simplefs_da_release(inode, iblock, count);
+	*phys = start;
+	*len = count;
+	err = SIMPLEFS_MAP_NEW;
+out:
+	up_write(&sinfo->i_extent_sem);
+	if (err == SIMPLEFS_MAP_NEW)
+		mark_inode_dirty(inode);
+	simplefs_journal_stop(handle);
+	trace_simplefs_map_blocks(inode, iblock, *len, *phys, create, err);
+	return err;
+}
+
+/* Fill the extent cache from the on-disk inode */
+int simplefs_ext_load(struct inode *inode, struct simplefs_inode *sinode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_extent_block *eb;
+	struct buffer_head *bh;
+	unsigned int i;
+
+	sinfo->i_extent_count = sinode->i_extent_count;
+	sinfo->i_extent_block = sinode->i_extent_block;
+
+	if (!sinfo->i_extent_block) {
+		if (sinfo->i_extent_count > SIMPLEFS_INODE_EXTENTS)
+			return -EIO;
+		memcpy(sinfo->i_extent_inline, sinode->i_extent, sizeof(sinode->i_extent));
+	} else {
+		if (sinfo->i_extent_count > SIMPLEFS_EXTENTS_PER_BLOCK)
+			return -EIO;
+		bh = sb_bread(inode->i_sb, sinfo->i_extent_block);
+		if (!bh)
+			return -EIO;
+		eb = (struct simplefs_extent_block *)bh->b_data;
+		if (eb->eb_count != sinfo->i_extent_count) {
+			brelse(bh);
+			return -EIO;
+		}
+		sinfo->i_extent = kcalloc(SIMPLEFS_EXTENTS_PER_BLOCK,
+				sizeof(struct simplefs_extent), GFP_NOFS);
+		if (!sinfo->i_extent) {
+			sinfo->i_extent = sinfo->i_extent_inline;
+			brelse(bh);
+			return -ENOMEM;
+		}
+		memcpy(sinfo->i_extent, eb->eb_extent,
+		       eb->eb_count * sizeof(struct simplefs_extent));
+		brelse(bh);
+		inode->i_blocks += inode->i_sb->s_blocksize >> 9;
+	}
+
+	for (i = 0; i < sinfo->i_extent_count; i++)
+		inode->i_blocks += (blkcnt_t)simplefs_ext_len(&sinfo->i_extent[i]) <<
+			(inode->i_blkbits - 9);
+	return 0;
+}
+
+/*
+ * Copy the extent cache back into the on-disk inode (and extent block),
+ * writing the extent block out before returning if @sync is set.
+ */
+int simplefs_ext_store(struct inode *inode, struct simplefs_inode *sinode, int sync)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_extent_block *eb;
+	struct buffer_head *bh;
+	int err = 0;
+
+	down_read(&sinfo->i_extent_sem);
+	sinode->i_extent_count = sinfo->i_extent_count;
+	sinode->i_extent_block = sinfo->i_extent_block;
+	memset(sinode->i_extent, 0, sizeof(sinode->i_extent));
+
+	if (!sinfo->i_extent_block) {
+		memcpy(sinode->i_extent, sinfo->i_extent,
+		       sinfo->i_extent_count * sizeof(struct simplefs_extent));
+		goto out;
+	}
+
+	bh = sb_bread(inode->i_sb, sinfo->i_extent_block);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = simplefs_get_write_access(bh);
+	if (err) {
+		brelse(bh);
+		goto out;
+	}
+	eb = (struct simplefs_extent_block *)bh->b_data;
+	eb->eb_count = sinfo->i_extent_count;
+	memcpy(eb->eb_extent, sinfo->i_extent,
+	       sinfo->i_extent_count * sizeof(struct simplefs_extent));
+	simplefs_dirty_metadata(bh, inode);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			err = -EIO;
+	}
+	brelse(bh);
+out:
+	up_read(&sinfo->i_extent_sem);
+	return err;
+}
+
+/*
+ * Free the blocks of one extent, a bitmap block's worth at a time so that
+ * each step fits in the journal handle.  Directory and symlink blocks are
+ * metadata and are forgotten first.  Fails, with the rest of the run still
+ * allocated, when the handle cannot get the credits or a bitmap block.
+ */
+static int simplefs_ext_free_run(struct inode *inode, sector_t start, sector_t len)
+{
+	struct super_block *sb = inode->i_sb;
+	sector_t step = sb->s_blocksize << 3, n, i;
+	int err;
+
+	while (len) {
+		n = min(len, step);
+		err = simplefs_journal_ensure_credits(SIMPLEFS_FREE_CREDITS);
+		if (err)
+			return err;
+		if (S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)) {
+			for (i = 0; i < n; i++)
+				simplefs_forget_block(sb, start + i);
+		}
+		err = simplefs_free_blocks(sb, start, n);
+		if (err)
+			return err;
+		start += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Release every block owned by an inode that is going away.  On failure
+ * the extents are left as they were, for fsck to find the blocks.
+ */
+int simplefs_ext_free(struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	unsigned int i;
+	int err = 0;
+
+	down_write(&sinfo->i_extent_sem);
+	for (i = 0; i < sinfo->i_extent_count && !err; i++)
+		err = simplefs_ext_free_run(inode, sinfo->i_extent[i].ee_start,
+				simplefs_ext_len(&sinfo->i_extent[i]));
+	if (!err && sinfo->i_extent_block)
+		err = simplefs_journal_ensure_credits(SIMPLEFS_FREE_CREDITS);
+	if (err)
+		goto out;
+	if (sinfo->i_extent_block) {
+		simplefs_forget_block(sb, sinfo->i_extent_block);
+		err = simplefs_free_blocks(sb, sinfo->i_extent_block, 1);
+		if (err)
+			goto out;
+		sinfo->i_extent_block = 0;
+	}
+	sinfo->i_extent_count = 0;
+	inode->i_blocks = 0;
+out:
+	up_write(&sinfo->i_extent_sem);
+	return err;
+}
+
+/*
+ * Give back every block from @from on, once a truncate has dropped their
+ * pages.  Extents are cut back one at a time from the end, each logged
+ * with the inode before its blocks go free, so that a crash in between
+ * leaks blocks rather than leaving them both free and mapped.
+ */
+int simplefs_ext_truncate(struct inode *inode, sector_t from)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_extent *ext;
+	sector_t start, len, end, eblk;
+	handle_t *handle;
+	int err = 0;
+
+	handle = simplefs_journal_start(sb, SIMPLEFS_MAP_CREDITS);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	for (;;) {
+		err = simplefs_journal_ensure_credits(SIMPLEFS_INODE_CREDITS +
+				SIMPLEFS_FREE_CREDITS);
+		if (err)
+			break;
+		down_write(&sinfo->i_extent_sem);
+		end = 0;
+		if (sinfo->i_extent_count) {
+			ext = &sinfo->i_extent[sinfo->i_extent_count - 1];
+			end = (sector_t)ext->ee_block + simplefs_ext_len(ext);
+		}
+		if (end <= from) {
+			up_write(&sinfo->i_extent_sem);
+			break;
+		}
+		if (ext->ee_block >= from) {
+			start = ext->ee_start;
+			len = simplefs_ext_len(ext);
+			sinfo->i_extent_count--;
+		} else {
+			start = ext->ee_start + (from - ext->ee_block);
+			len = end - from;
+			ext->ee_len = (ext->ee_len & SIMPLEFS_EXT_UNWRITTEN) |
+				(from - ext->ee_block);
+		}
+		inode->i_blocks -= (blkcnt_t)len << (inode->i_blkbits - 9);
+		/* the last extent gone, the extent block goes with it */
+		eblk = 0;
+		if (!sinfo->i_extent_count && sinfo->i_extent_block) {
+			eblk = sinfo->i_extent_block;
+			sinfo->i_extent_block = 0;
+			simplefs_ext_release(sinfo);
+			inode->i_blocks -= sb->s_blocksize >> 9;
+		}
+		up_write(&sinfo->i_extent_sem);
+		mark_inode_dirty(inode);
+
+		err = simplefs_ext_free_run(inode, start, len);
+		if (err)
+			break;
+		if (eblk) {
+			err = simplefs_journal_ensure_credits(SIMPLEFS_FREE_CREDITS);
+			if (err)
+				break;
+			simplefs_forget_block(sb, eblk);
+			err = simplefs_free_blocks(sb, eblk, 1);
+			if (err)
+				break;
+		}
+	}
+	simplefs_journal_stop(handle);
+	return err;
+}
+
+void simplefs_ext_release(struct simplefs_inode_info *sinfo)
+{
+	if (sinfo->i_extent != sinfo->i_extent_inline)
+		kfree(sinfo->i_extent);
+	sinfo->i_extent = sinfo->i_extent_inline;
+}
+
+/* First logical block past the last extent */
+sector_t simplefs_ext_end(struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_extent *ext;
+	sector_t end = 0;
+
+	down_read(&sinfo->i_extent_sem);
+	if (sinfo->i_extent_count) {
+		ext = &sinfo->i_extent[sinfo->i_extent_count - 1];
+		end = (sector_t)ext->ee_block + simplefs_ext_len(ext);
+	}
+	up_read(&sinfo->i_extent_sem);
+	return end;
+}
+
+/*
+ * Delayed allocation.  A buffered write into a hole only reserves its
+ * blocks and records them in i_delalloc; writeback allocates each run of
+ * dirty pages in one go once it knows how long the run is.  Pages dropped
+ * before writeback, such as those of a deleted temporary file, never
+ * touch the bitmap.
+ */
+int simplefs_da_reserve(struct inode *inode, sector_t iblock, unsigned int len)
+{
+	struct xarray *xa = &simplefs_i(inode)->i_delalloc;
+	unsigned int i, n = 0;
+	int err;
+
+	for (i = 0; i < len; i++) {
+		if (!xa_load(xa, iblock + i))
+			n++;
+	}
+	if (!n)
+		return 0;
+	err = simplefs_reserve_blocks(inode->i_sb, n);
+	if (err)
+		return err;
+
+	for (i = 0; i < len && n; i++) {
+		err = xa_insert(xa, iblock + i, xa_mk_value(1), GFP_NOFS);
+		if (err == -EBUSY)
+			continue;
+		if (err)
+			break;
+		n--;
+	}
+	/* raced with ->page_mkwrite, or out of memory */
+	if (n)
+		simplefs_release_blocks(inode->i_sb, n);
+	return err == -EBUSY ? 0 : err;
+}
+
+/* Forget the reservations in a range, before allocating it or when unused */
+void simplefs_da_release(struct inode *inode, sector_t iblock, unsigned int len)
+{
+	struct xarray *xa = &simplefs_i(inode)->i_delalloc;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (xa_erase(xa, iblock + i))
+			n++;
+	}
+	if (n)
+		simplefs_release_blocks(inode->i_sb, n);
+}
+
+/* Give back the reservations from @from on, for pages a truncate dropped */
+void simplefs_da_truncate(struct inode *inode, sector_t from)
+{
+	struct xarray *xa = &simplefs_i(inode)->i_delalloc;
+	unsigned long index = from;
+	unsigned int n = 0;
+
+	while (xa_find(xa, &index, ULONG_MAX, XA_PRESENT)) {
+		if (xa_erase(xa, index))
+			n++;
+	}
+	if (n)
+		simplefs_release_blocks(inode->i_sb, n);
+}
+
+/* The inode is going away with whatever it still has reserved */
+void simplefs_da_drop(struct inode *inode)
+{
+	struct xarray *xa = &simplefs_i(inode)->i_delalloc;
+	unsigned long index;
+	unsigned int n = 0;
+	void *entry;
+
+	xa_for_each(xa, index, entry)
+		n++;
+	xa_destroy(xa);
+	if (n)
+		simplefs_release_blocks(inode->i_sb, n);
+}
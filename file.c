@@ -1,96 +1,701 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/bio.h>
+#include <linux/iomap.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
 #include <linux/uio.h>
 #include <linux/dax.h>
+#include <linux/falloc.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/wait_bit.h>
+#include <linux/jbd2.h>
 #include "simple.h"
 
+/*
+ * Without a journal the generic helper writes the inode and the buffers
+ * dirtied on its behalf; the extents writeback allocated leave the inode
+ * I_DIRTY_DATASYNC, so fdatasync writes it too, and the extent block goes
+ * out with it.  Under a journal the metadata is safe once the last
+ * transaction that touched the inode commits.  The data goes first, and
+ * since delayed allocation logs the new extents from writeback, the
+ * transaction to wait for is only known after it.
+ */
+int simplefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	journal_t *journal = simplefs_sb(inode->i_sb)->journal;
+	tid_t tid;
+	bool flush;
+	int err, err2;
+
+	if (!journal)
+		return generic_file_fsync(file, start, end, datasync);
+
+	err = file_write_and_wait_range(file, start, end);
+	if (err)
+		return err;
+	/* log timestamps that lazytime has been holding back */
+	if (!datasync) {
+		err = sync_inode_metadata(inode, 1);
+		if (err)
+			return err;
+	}
+	tid = READ_ONCE(simplefs_i(inode)->i_sync_tid);
+	flush = (journal->j_flags & JBD2_BARRIER) &&
+		!jbd2_trans_will_send_data_barrier(journal, tid);
+	err = jbd2_complete_transaction(journal, tid);
+	if (flush) {
+		err2 = blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+		if (!err)
+			err = err2;
+	}
+	return err;
+}
+
+/*
+ * File data goes through iomap.  One ->iomap_begin call maps a whole
+ * extent, so readahead, buffered writes and direct I/O walk a file an
+ * extent at a time instead of a block at a time.  Direct and DAX writes
+ * allocate the blocks they cover up front, as contiguously as the bitmap
+ * allows; buffered writes into a hole only reserve them and leave the
+ * allocation to writeback.  Small files kept in the inode are dealt with
+ * before any of this, see inline.c.
+ */
+#define SIMPLEFS_DA_CHUNK	256	/* blocks reserved per ->iomap_begin */
+
+static int simplefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+		unsigned flags, struct iomap *iomap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t iblock = pos >> blkbits;
+	sector_t last = (pos + length - 1) >> blkbits;
+	unsigned int len = min_t(sector_t, last - iblock + 1, U32_MAX);
+	bool delalloc = (flags & IOMAP_WRITE) && !(flags & IOMAP_DIRECT) && !IS_DAX(inode);
+	sector_t phys;
+	int ret;
+
+	/* only fiemap asks about an inline file, the I/O paths handle it first */
+	if (simplefs_has_inline(inode) && pos < i_size_read(inode)) {
+		iomap->bdev = inode->i_sb->s_bdev;
+		iomap->type = IOMAP_INLINE;
+		iomap->flags = 0;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = 0;
+		iomap->length = i_size_read(inode);
+		iomap->inline_data = simplefs_i(inode)->i_inline;
+		return 0;
+	}
+
+	ret = simplefs_map_blocks(inode, iblock, &len, &phys,
+			(flags & IOMAP_WRITE) && !delalloc);
+	if (ret < 0)
+		return ret;
+	if (!phys && delalloc) {
+		len = min_t(unsigned int, len, SIMPLEFS_DA_CHUNK);
+		ret = simplefs_da_reserve(inode, iblock, len);
+		if (ret)
+			return ret;
+	}
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->dax_dev = simplefs_sb(inode->i_sb)->s_daxdev;
+	iomap->offset = (u64)iblock << blkbits;
+	iomap->length = (u64)len << blkbits;
+	iomap->flags = 0;
+	if (!phys) {
+		iomap->type = delalloc ? IOMAP_DELALLOC : IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+	} else {
+		iomap->type = ret == SIMPLEFS_MAP_UNWRITTEN ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)phys << blkbits;
+		if (ret == SIMPLEFS_MAP_NEW)
+			iomap->flags |= IOMAP_F_NEW;
+	}
+	return 0;
+}
+
+/*
+ * A short buffered write leaves reservations behind for blocks it never
+ * got to.  Give back those whose page is not dirty; writeback takes care
+ * of the others.
+ */
+static int simplefs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+		ssize_t written, unsigned flags, struct iomap *iomap)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t iblock = (pos + written + (1 << blkbits) - 1) >> blkbits;
+	sector_t end = (pos + length + (1 << blkbits) - 1) >> blkbits;
+	struct page *page;
+	bool dirty;
+
+	if (iomap->type != IOMAP_DELALLOC)
+		return 0;
+	for (; iblock < end; iblock++) {
+		page = find_get_page(inode->i_mapping, iblock);
+		dirty = page && PageDirty(page);
+		if (page)
+			put_page(page);
+		if (!dirty)
+			simplefs_da_release(inode, iblock, 1);
+	}
+	return 0;
+}
+
+const struct iomap_ops simplefs_iomap_ops = {
+	.iomap_begin		= simplefs_iomap_begin,
+	.iomap_end		= simplefs_iomap_end,
+};
+
+/*
+ * iomap leaves the size of a direct write past EOF to us, and the unwritten
+ * extents it filled, which only become written once the data is there.
+ */
+static int simplefs_dio_end_io(struct kiocb *iocb, ssize_t size, unsigned flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t first, last;
+	int err;
+
+	if (size <= 0)
+		return size;
+	if (flags & IOMAP_DIO_UNWRITTEN) {
+		first = iocb->ki_pos >> blkbits;
+		last = (iocb->ki_pos + size - 1) >> blkbits;
+		err = simplefs_ext_convert(inode, first, last - first + 1, false);
+		if (err)
+			return err;
+	}
+	if ((flags & IOMAP_DIO_WRITE) && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static ssize_t simplefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	/* direct reads of an inline file fall back to the page cache */
+	if (simplefs_has_inline(inode) ||
+	    (!IS_DAX(inode) && !(iocb->ki_flags & IOCB_DIRECT)))
+		return generic_file_read_iter(iocb, to);
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	if (IS_DAX(inode))
+		ret = dax_iomap_rw(iocb, to, &simplefs_iomap_ops);
+	else
+		ret = iomap_dio_rw(iocb, to, &simplefs_iomap_ops, NULL);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+static ssize_t simplefs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out;
+	ret = file_update_time(file);
+	if (ret)
+		goto out;
+
+	if (simplefs_has_inline(inode)) {
+		if (!(iocb->ki_flags & IOCB_DIRECT) &&
+		    iocb->ki_pos + iov_iter_count(from) <= SIMPLEFS_INLINE_SIZE) {
+			ret = generic_perform_write(file, from, iocb->ki_pos);
+			if (ret > 0)
+				iocb->ki_pos += ret;
+			goto out;
+		}
+		ret = simplefs_inline_convert(inode);
+		if (ret)
+			goto out;
+	}
+
+	if (IS_DAX(inode)) {
+		ret = dax_iomap_rw(iocb, from, &simplefs_iomap_ops);
+		if (ret > 0 && iocb->ki_pos > i_size_read(inode)) {
+			i_size_write(inode, iocb->ki_pos);
+			mark_inode_dirty(inode);
+		}
+	} else if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = iomap_dio_rw(iocb, from, &simplefs_iomap_ops, simplefs_dio_end_io);
+	} else {
+		ret = iomap_file_buffered_write(iocb, from, &simplefs_iomap_ops);
+		if (ret > 0)
+			iocb->ki_pos += ret;
+	}
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static vm_fault_t simplefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+	int err;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	/* stores through a mapping never reach i_inline */
+	err = simplefs_has_inline(inode) ? simplefs_inline_convert(inode) : 0;
+	if (err)
+		ret = vmf_error(err);
+	else
+		ret = iomap_page_mkwrite(vmf, &simplefs_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct simplefs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= simplefs_page_mkwrite,
+};
+
+/*
+ * DAX maps the blocks themselves.  dax_iomap_fault() installs a 2 MiB
+ * entry whenever the extent under an aligned PMD range is long enough and
+ * aligned on disk, which SIMPLEFS_DAX_ALIGN makes likely for new files.
+ * i_dax_sem keeps truncate and zero-range from freeing or unwriting a
+ * block between its lookup and the PTE pointing at it.
+ */
+static vm_fault_t simplefs_dax_huge_fault(struct vm_fault *vmf,
+		enum page_entry_size pe_size)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	bool write = vmf->flags & FAULT_FLAG_WRITE;
+	vm_fault_t ret;
+
+	if (write) {
+		sb_start_pagefault(inode->i_sb);
+		file_update_time(vmf->vma->vm_file);
+	}
+	down_read(&simplefs_i(inode)->i_dax_sem);
+	ret = dax_iomap_fault(vmf, pe_size, NULL, NULL, &simplefs_iomap_ops);
+	up_read(&simplefs_i(inode)->i_dax_sem);
+	if (write)
+		sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static vm_fault_t simplefs_dax_fault(struct vm_fault *vmf)
+{
+	return simplefs_dax_huge_fault(vmf, PE_SIZE_PTE);
+}
+
+static const struct vm_operations_struct simplefs_dax_vm_ops = {
+	.fault		= simplefs_dax_fault,
+	.huge_fault	= simplefs_dax_huge_fault,
+	.page_mkwrite	= simplefs_dax_fault,
+	.pfn_mkwrite	= simplefs_dax_fault,
+};
+
+static void simplefs_wait_dax_page(struct inode *inode)
+{
+	up_write(&simplefs_i(inode)->i_dax_sem);
+	schedule();
+	down_write(&simplefs_i(inode)->i_dax_sem);
+}
+
+/*
+ * get_user_pages() can hold on to DAX pages after they are unmapped.  Wait
+ * for those to be let go before their blocks change hands.  Called with
+ * i_dax_sem held for writing, dropped while sleeping.
+ */
+static int simplefs_break_layouts(struct inode *inode)
+{
+	struct page *page;
+	int err;
+
+	if (!IS_DAX(inode))
+		return 0;
+	do {
+		page = dax_layout_busy_page(inode->i_mapping);
+		if (!page)
+			return 0;
+		err = ___wait_var_event(&page->_refcount,
+				atomic_read(&page->_refcount) == 1,
+				TASK_INTERRUPTIBLE, 0, 0,
+				simplefs_wait_dax_page(inode));
+	} while (!err);
+	return err;
+}
+
+static int simplefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	if (IS_DAX(file_inode(file))) {
+		vma->vm_ops = &simplefs_dax_vm_ops;
+		vma->vm_flags |= VM_HUGEPAGE;
+	} else {
+		vma->vm_ops = &simplefs_file_vm_ops;
+	}
+	return 0;
+}
+
+/* Zero [@start, @end) through the page cache, leaving out anything past EOF */
+static int simplefs_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+	end = min(end, i_size_read(inode));
+	if (start >= end)
+		return 0;
+	return iomap_zero_range(inode, start, end - start, NULL, &simplefs_iomap_ops);
+}
+
+/*
+ * FALLOC_FL_ZERO_RANGE: whole blocks are dropped from the page cache and
+ * their extents turned unwritten, which costs no data I/O; the partial
+ * blocks at the edges are zeroed.  Writing back the range first leaves
+ * no delayed or unconverted data behind to get in the way.
+ */
+static int simplefs_zero_range(struct inode *inode, loff_t offset, loff_t end)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t start = round_up(offset, 1 << blkbits);
+	loff_t stop = round_down(end, 1 << blkbits);
+	int err;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (err)
+		return err;
+	if (start >= stop)
+		return simplefs_zero_partial(inode, offset, end);
+
+	down_write(&simplefs_i(inode)->i_dax_sem);
+	err = simplefs_break_layouts(inode);
+	if (!err) {
+		truncate_pagecache_range(inode, start, stop - 1);
+		err = simplefs_ext_convert(inode, start >> blkbits,
+				(stop - start) >> blkbits, true);
+	}
+	up_write(&simplefs_i(inode)->i_dax_sem);
+	if (!err)
+		err = simplefs_zero_partial(inode, offset, start);
+	if (!err)
+		err = simplefs_zero_partial(inode, stop, end);
+	return err;
+}
+
+/*
+ * Preallocation fills the holes in the range with unwritten extents, as
+ * contiguous as the bitmap allows.  They read as zeros without any I/O
+ * and turn into written extents once data reaches them.
+ */
+static long simplefs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	unsigned int blkbits = inode->i_blkbits;
+	loff_t end = offset + len;
+	sector_t iblock, last, phys;
+	unsigned int count;
+	long ret;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto out;
+	}
+	inode_dio_wait(inode);
+	if (simplefs_has_inline(inode)) {
+		ret = simplefs_inline_convert(inode);
+		if (ret)
+			goto out;
+	}
+
+	if (mode & FALLOC_FL_ZERO_RANGE) {
+		ret = simplefs_zero_range(inode, offset, end);
+		if (ret)
+			goto out;
+	}
+
+	iblock = offset >> blkbits;
+	last = (end - 1) >> blkbits;
+	while (iblock <= last) {
+		count = min_t(sector_t, last - iblock + 1, U32_MAX);
+		ret = simplefs_map_blocks(inode, iblock, &count, &phys,
+				SIMPLEFS_MAP_PREALLOC);
+		if (ret < 0)
+			goto out;
+		/* dirty pages in a new extent no longer need their reservation */
+		if (ret == SIMPLEFS_MAP_NEW)
+			simplefs_da_release(inode, iblock, count);
+		iblock += count;
+	}
+
+	ret = 0;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+		i_size_write(inode, end);
+	inode->i_ctime = current_time(inode);
+	if (mode & FALLOC_FL_ZERO_RANGE)
+		inode->i_mtime = inode->i_ctime;
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return ret;
+}
+
 const struct file_operations simplefs_file_operations = {
 	.llseek         = generic_file_llseek,
-	.read_iter      = generic_file_read_iter,
-	.write_iter     = generic_file_write_iter,
-	.mmap           = generic_file_mmap,
-	.fsync          = generic_file_fsync,
+	.read_iter      = simplefs_file_read_iter,
+	.write_iter     = simplefs_file_write_iter,
+	.mmap           = simplefs_file_mmap,
+	.fsync          = simplefs_fsync,
 	.splice_read    = generic_file_splice_read,
+	.splice_write   = iter_file_splice_write,
+	.fallocate      = simplefs_fallocate,
 };
 
-static int simplefs_get_block(struct inode *inode, sector_t block,
-		struct buffer_head *bh_result, int create)
-{
-	unsigned long phys;
-	struct super_block *sb = inode->i_sb;
-	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+/*
+ * Writeback.  The blocks behind a dirty page are looked up an extent at a
+ * time, and pages that are contiguous on disk are packed into one bio.  A
+ * page over a hole was written with delayed allocation: it and the dirty
+ * pages right behind it get one allocation, so a file built from many
+ * small appends still ends up in a single extent.  A block is one page.
+ */
+struct simplefs_writepage_ctx {
+	struct bio *bio;
+	struct simplefs_ioend *io;	/* set when the bio fills unwritten blocks */
+	sector_t iblock;	/* cached extent: first logical block, */
+	sector_t phys;		/* its first physical block, */
+	unsigned int len;	/* its length, 0 when nothing is cached */
+	bool unwritten;		/* and whether it is unwritten */
+	sector_t next;		/* physical block that extends the bio */
+};
 
-	phys = sinfo->data_block_number + block;
-	map_bh(bh_result, sb, phys);
+/*
+ * A bio writing into an unwritten extent carries one of these.  Once the
+ * data is on disk the extent is converted from s_unwritten_wq, and only
+ * then does page writeback end, so fsync finds the conversion done.
+ */
+struct simplefs_ioend {
+	struct work_struct work;
+	struct bio *bio;
+	struct inode *inode;
+	sector_t iblock;	/* logical blocks the bio covers */
+	unsigned int len;
+};
 
-	return 0;
+static void simplefs_finish_bio(struct bio *bio)
+{
+	int err = blk_status_to_errno(bio->bi_status);
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bvec;
+	int i;
+
+	bio_for_each_segment_all(bvec, bio, i, iter_all) {
+		if (err) {
+			SetPageError(bvec->bv_page);
+			mapping_set_error(bvec->bv_page->mapping, err);
+		}
+		end_page_writeback(bvec->bv_page);
+	}
+	kfree(bio->bi_private);
+	bio_put(bio);
 }
 
-static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
+static void simplefs_unwritten_work(struct work_struct *work)
 {
-	return block_write_full_page(page, simplefs_get_block, wbc);
+	struct simplefs_ioend *io = container_of(work, struct simplefs_ioend, work);
+	struct bio *bio = io->bio;
+	int err;
+
+	err = simplefs_ext_convert(io->inode, io->iblock, io->len, false);
+	if (err) {
+		printk(KERN_ERR "simplefs: %s: cannot convert unwritten blocks of inode %lu: %d\n",
+				io->inode->i_sb->s_id, io->inode->i_ino, err);
+		bio->bi_status = errno_to_blk_status(err);
+	}
+	simplefs_finish_bio(bio);
 }
 
-static int simplefs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+static void simplefs_end_bio(struct bio *bio)
 {
-	return mpage_writepages(mapping, wbc, simplefs_get_block);
+	struct simplefs_ioend *io = bio->bi_private;
+
+	if (io && !bio->bi_status) {
+		queue_work(simplefs_sb(io->inode->i_sb)->s_unwritten_wq, &io->work);
+		return;
+	}
+	simplefs_finish_bio(bio);
 }
 
-static int simplefs_readpage(struct file *file, struct page *page)
+static void simplefs_submit_wpc(struct simplefs_writepage_ctx *wpc)
 {
-	return block_read_full_page(page, simplefs_get_block);
+	if (wpc->bio)
+		submit_bio(wpc->bio);
+	wpc->bio = NULL;
+	wpc->io = NULL;
 }
 
-static int simplefs_readpages(struct file *file, struct address_space *mapping,
-		struct list_head *pages, unsigned nr_pages)
+/* How many pages from @index on are dirty without a gap, at most @max */
+static unsigned int simplefs_dirty_run(struct address_space *mapping,
+		pgoff_t index, unsigned int max)
 {
-	return mpage_readpages(mapping, pages, nr_pages, simplefs_get_block);
+	pgoff_t next = index + 1, end = index + max - 1;
+	unsigned int run = 1, i, nr;
+	struct pagevec pvec;
+
+	pagevec_init(&pvec);
+	while (run < max) {
+		nr = pagevec_lookup_range_tag(&pvec, mapping, &next, end,
+				PAGECACHE_TAG_DIRTY);
+		if (!nr)
+			break;
+		for (i = 0; i < nr && pvec.pages[i]->index == index + run; i++)
+			run++;
+		pagevec_release(&pvec);
+		if (i < nr)
+			break;
+	}
+	return run;
 }
 
-static void simplefs_write_failed(struct address_space *mapping, loff_t to)
+static int simplefs_do_writepage(struct page *page, struct writeback_control *wbc,
+		void *data)
 {
-	struct inode *inode = mapping->host;
+	struct simplefs_writepage_ctx *wpc = data;
+	struct inode *inode = page->mapping->host;
+	loff_t size = i_size_read(inode);
+	pgoff_t end_index = size >> PAGE_SHIFT;
+	unsigned int offset = size & (PAGE_SIZE - 1);
+	sector_t iblock = page->index, blk;
+	unsigned int len;
+	int err;
+
+	if (page->index > end_index || (page->index == end_index && !offset)) {
+		/* truncated away while it waited */
+		unlock_page(page);
+		return 0;
+	}
+	if (page->index == end_index)
+		zero_user_segment(page, offset, PAGE_SIZE);
+
+	if (!wpc->len || iblock < wpc->iblock || iblock >= wpc->iblock + wpc->len) {
+		len = end_index - page->index + 1;
+		err = simplefs_map_blocks(inode, iblock, &len, &blk, 0);
+		if (!err && !blk) {
+			len = simplefs_dirty_run(page->mapping, page->index, len);
+			/* the pages past the run it maps keep their reservation */
+			err = simplefs_map_blocks(inode, iblock, &len, &blk,
+					SIMPLEFS_MAP_DELALLOC);
+		}
+		if (err < 0) {
+			mapping_set_error(page->mapping, err);
+			unlock_page(page);
+			return err;
+		}
+		wpc->iblock = iblock;
+		wpc->phys = blk;
+		wpc->len = len;
+		wpc->unwritten = err == SIMPLEFS_MAP_UNWRITTEN;
+	}
+	blk = wpc->phys + (iblock - wpc->iblock);
+
+	/* an ioend covers a single logical range of unwritten blocks */
+	if (wpc->bio && (blk != wpc->next || !wpc->io != !wpc->unwritten ||
+			 (wpc->io && iblock != wpc->io->iblock + wpc->io->len)))
+		simplefs_submit_wpc(wpc);
+again:
+	if (!wpc->bio) {
+		wpc->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+		bio_set_dev(wpc->bio, inode->i_sb->s_bdev);
+		wpc->bio->bi_iter.bi_sector = blk << (inode->i_blkbits - 9);
+		wpc->bio->bi_opf = REQ_OP_WRITE | wbc_to_write_flags(wbc);
+		wpc->bio->bi_end_io = simplefs_end_bio;
+		wbc_init_bio(wbc, wpc->bio);
+		if (wpc->unwritten) {
+			wpc->io = kmalloc(sizeof(*wpc->io), GFP_NOFS | __GFP_NOFAIL);
+			INIT_WORK(&wpc->io->work, simplefs_unwritten_work);
+			wpc->io->bio = wpc->bio;
+			wpc->io->inode = inode;
+			wpc->io->iblock = iblock;
+			wpc->io->len = 0;
+			wpc->bio->bi_private = wpc->io;
+		}
+	}
+	if (bio_add_page(wpc->bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		simplefs_submit_wpc(wpc);
+		goto again;
+	}
+	if (wpc->io)
+		wpc->io->len++;
+	wbc_account_io(wbc, page, PAGE_SIZE);
+	wpc->next = blk + 1;
 
-	if (to > inode->i_size)
-		truncate_pagecache(inode, inode->i_size);
+	set_page_writeback(page);
+	unlock_page(page);
+	return 0;
 }
 
-static int simplefs_write_begin(struct file *file, struct address_space *mapping,
-		loff_t pos, unsigned len, unsigned flags,
-		struct page **pagep, void **fsdata)
+static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
 {
+	struct simplefs_writepage_ctx wpc = { 0 };
 	int ret;
-	struct inode *inode = mapping->host;
-	struct simplefs_inode_info *sinfo = simplefs_i(inode);
 
-	ret = block_write_begin(mapping, pos, len, flags, pagep,
-			simplefs_get_block);
-	if (unlikely(ret))
-		simplefs_write_failed(mapping, pos + len);
-	sinfo->file_size += len;
+	ret = simplefs_do_writepage(page, wbc, &wpc);
+	simplefs_submit_wpc(&wpc);
+	return ret;
+}
+
+static int simplefs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct simplefs_writepage_ctx wpc = { 0 };
+	int ret;
 
+	ret = write_cache_pages(mapping, wbc, simplefs_do_writepage, &wpc);
+	simplefs_submit_wpc(&wpc);
 	return ret;
 }
 
-static sector_t simplefs_bmap(struct address_space *mapping, sector_t block)
+static int simplefs_readpage(struct file *file, struct page *page)
 {
-	return generic_block_bmap(mapping, block, simplefs_get_block);
+	struct inode *inode = page->mapping->host;
+
+	if (simplefs_has_inline(inode))
+		return simplefs_inline_readpage(inode, page);
+	return iomap_readpage(page, &simplefs_iomap_ops);
 }
 
-static ssize_t simplefs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+static int simplefs_readpages(struct file *file, struct address_space *mapping,
+		struct list_head *pages, unsigned nr_pages)
 {
-	struct file *file = iocb->ki_filp;
-	struct address_space *mapping = file->f_mapping;
-	struct inode *inode = mapping->host;
-	size_t count = iov_iter_count(iter);
-	loff_t offset = iocb->ki_pos;
-	ssize_t ret;
+	/* no readahead for inline files, ->readpage fills the one page */
+	if (simplefs_has_inline(mapping->host))
+		return 0;
+	return iomap_readpages(mapping, pages, nr_pages, &simplefs_iomap_ops);
+}
 
-	ret = blockdev_direct_IO(iocb, inode, iter, simplefs_get_block);
-	if (ret < 0 && iov_iter_rw(iter) == WRITE)
-		simplefs_write_failed(mapping, offset + count);
-	return ret;
+static sector_t simplefs_bmap(struct address_space *mapping, sector_t block)
+{
+	/* delayed blocks have no address until they are written */
+	if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+	return iomap_bmap(mapping, block, &simplefs_iomap_ops);
 }
 
 static int simplefs_dax_writepages(struct address_space *mapping, struct writeback_control *wbc)
@@ -105,11 +710,14 @@ const struct address_space_operations simplefs_aops = {
 	.writepage		= simplefs_writepage,
 	.writepages		= simplefs_writepages,
 	.write_begin		= simplefs_write_begin,
-	.write_end		= generic_write_end,
+	.write_end		= simplefs_write_end,
+	.set_page_dirty		= iomap_set_page_dirty,
+	.releasepage		= iomap_releasepage,
+	.invalidatepage		= iomap_invalidatepage,
 	.bmap			= simplefs_bmap,
-	.direct_IO		= simplefs_direct_IO,
-	.migratepage            = buffer_migrate_page,
-	.is_partially_uptodate  = block_is_partially_uptodate,
+	.direct_IO		= noop_direct_IO,
+	.migratepage            = iomap_migrate_page,
+	.is_partially_uptodate  = iomap_is_partially_uptodate,
 	.error_remove_page      = generic_error_remove_page,
 };
 
@@ -120,4 +728,70 @@ const struct address_space_operations simplefs_dax_aops = {
 	.invalidatepage         = noop_invalidatepage,
 };
 
-const struct inode_operations simplefs_file_inops;
+static int simplefs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	return iomap_fiemap(inode, fieinfo, start, len, &simplefs_iomap_ops);
+}
+
+/*
+ * A file must not keep data past its new size: an inline file has
+ * already cleared the tail of i_data, any other one zeroes the rest of its
+ * last block and gives back the blocks and reservations past it, so that
+ * growing it again reads zeros.
+ */
+static int simplefs_setsize(struct inode *inode, loff_t size)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	sector_t from = DIV_ROUND_UP(size, inode->i_sb->s_blocksize);
+	bool shrink = size < i_size_read(inode) && !simplefs_has_inline(inode);
+	int err = 0;
+
+	if (shrink)
+		inode_dio_wait(inode);
+	down_write(&sinfo->i_dax_sem);
+	if (shrink) {
+		err = simplefs_break_layouts(inode);
+		if (!err)
+			err = simplefs_zero_partial(inode, size,
+					(loff_t)from << inode->i_blkbits);
+		if (err)
+			goto out;
+	}
+	truncate_setsize(inode, size);
+	simplefs_da_truncate(inode, from);
+	if (shrink)
+		err = simplefs_ext_truncate(inode, from);
+out:
+	up_write(&sinfo->i_dax_sem);
+	return err;
+}
+
+/* simple_setattr(), with the size change done by simplefs_setsize() */
+static int simplefs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	int err;
+
+	err = setattr_prepare(dentry, attr);
+	if (err)
+		return err;
+	if ((attr->ia_valid & ATTR_SIZE) && simplefs_has_inline(inode)) {
+		err = simplefs_inline_truncate(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+		err = simplefs_setsize(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+const struct inode_operations simplefs_file_inops = {
+	.setattr	= simplefs_setattr,
+	.fiemap		= simplefs_fiemap,
+};
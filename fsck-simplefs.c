@@ -0,0 +1,947 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "simple_fs.h"
+
+/*
+ * fsck-simplefs: check a simplefs image and repair what it safely can.
+ *
+ * The image is mapped whole and the metadata area read ahead in one go, so
+ * the passes below work on memory filled by large sequential reads.
+ *
+ * Pass 1 hands the inode table out to the worker threads a chunk at a
+ * time.  Each inode is validated and the blocks its extents cover are
+ * claimed in a shared bitmap; a block claimed twice is a duplicate.
+ * Pass 2 hands out the directories the same way: their index and leaf
+ * blocks are checked, names of missing inodes dropped, and every name
+ * collected.  Pass 3 is serial: it walks the tree from the root, frees
+ * the inodes no reachable name refers to and corrects the link counts.
+ * Pass 4 rebuilds both bitmaps and the super block counters from what
+ * the others found.
+ *
+ * Nothing is written unless -y is given.  Damage that cannot be undone
+ * safely (a corrupt directory block or index, blocks owned twice) is only
+ * reported, and while any directory is damaged unattached inodes are kept,
+ * since their names may be in it.
+ */
+
+/* Exit codes, as for e2fsck */
+#define FSCK_OK		0
+#define FSCK_FIXED	1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR	8
+
+#define SIMPLEFS_INODES_PER_BLOCK \
+	(SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode))
+
+#define SIMPLEFS_MAX_THREADS 64
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+
+/* Inode table blocks and directories a thread takes at a time */
+#define ITABLE_CHUNK	64
+#define DIR_CHUNK	16
+
+/* Duplicate blocks listed before the rest are only counted */
+#define MAX_DUP_REPORT	16
+
+enum { INO_FREE, INO_USED, INO_BAD };
+
+/* A name found in a directory */
+struct edge {
+	uint64_t dir;
+	uint64_t ino;
+};
+
+struct worker {
+	pthread_t thread;
+	struct edge *edges;
+	size_t nedges, cap;
+	int failed;
+};
+
+static uint8_t *image;
+static struct simplefs_super_block *sb;
+static int repair;
+
+static uint8_t *istate;		/* INO_* for each inode number */
+static uint32_t *refs;		/* names from reachable directories */
+static uint64_t *claimed;	/* blocks owned by some inode */
+static uint64_t *dupmap;		/* blocks owned more than once */
+static uint64_t *dirs;		/* directories, for pass 2 */
+static uint64_t ndirs;
+static unsigned long lost;	/* damaged directories */
+
+static void (*pass_fn)(struct worker *, uint64_t);
+static uint64_t pass_next, pass_total, pass_chunk;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long errors, fixed;
+
+static inline void *block(uint64_t n)
+{
+	return image + n * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+}
+
+static inline struct simplefs_inode *raw_inode(uint64_t ino)
+{
+	return (struct simplefs_inode *)block(sb->inodestore_block) +
+		(ino - SIMPLEFS_ROOTDIR_INODE_NUMBER);
+}
+
+static inline uint32_t ext_len(const struct simplefs_extent *ext)
+{
+	return ext->ee_len & ~SIMPLEFS_EXT_UNWRITTEN;
+}
+
+static inline int test_bit(const uint64_t *map, uint64_t nr)
+{
+	return (map[nr / 64] >> (nr % 64)) & 1;
+}
+
+/* Must match simplefs_dirhash() in htree.c */
+static uint32_t dirhash(const unsigned char *name, int len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *name++;
+		hash *= 0x01000193;
+	}
+	return hash % SIMPLEFS_HASH_EOF;
+}
+
+static uint8_t mode_to_ftype(uint16_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFDIR:
+		return SIMPLEFS_FT_DIR;
+	case S_IFLNK:
+		return SIMPLEFS_FT_SYMLINK;
+	default:
+		return SIMPLEFS_FT_REG_FILE;
+	}
+}
+
+/*
+ * Print one problem.  @fix says what repairing does about it, NULL if
+ * nothing can be done.  Returns true when the caller is to do it.
+ */
+static int report(const char *fix, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	if (fix && repair) {
+		printf(", %s\n", fix);
+		fixed++;
+	} else {
+		printf("\n");
+		errors++;
+	}
+	pthread_mutex_unlock(&report_lock);
+	return fix && repair;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t i, end;
+
+	for (;;) {
+		i = __atomic_fetch_add(&pass_next, pass_chunk, __ATOMIC_RELAXED);
+		if (i >= pass_total)
+			break;
+		end = i + pass_chunk < pass_total ? i + pass_chunk : pass_total;
+		for (; i < end; i++)
+			pass_fn(w, i);
+	}
+	return NULL;
+}
+
+/* Run @fn on items [0, @total) across the workers, @chunk at a time */
+static int run_pass(struct worker *workers, int nthreads,
+		void (*fn)(struct worker *, uint64_t), uint64_t total, uint64_t chunk)
+{
+	int i, started;
+
+	pass_fn = fn;
+	pass_next = 0;
+	pass_total = total;
+	pass_chunk = chunk;
+	for (started = 0; started < nthreads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, worker_run,
+				   &workers[started]))
+			break;
+	}
+	/* short of threads, take the slot of the first one missing */
+	if (started < nthreads)
+		worker_run(&workers[started]);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	for (i = 0; i < nthreads; i++) {
+		if (workers[i].failed)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * The extent map of a pass 1 checked inode, in the inode or in its extent
+ * block
+ */
+static struct simplefs_extent *inode_extents(struct simplefs_inode *raw,
+		unsigned int *count)
+{
+	*count = raw->i_extent_count;
+	if (raw->i_extent_block)
+		return ((struct simplefs_extent_block *)block(raw->i_extent_block))->eb_extent;
+	return raw->i_extent;
+}
+
+static int data_range(uint64_t start, uint64_t len)
+{
+	return start >= sb->data_block && start < sb->blocks_count &&
+		len <= sb->blocks_count - start;
+}
+
+static void claim(uint64_t blk)
+{
+	uint64_t bit = 1ULL << (blk % 64);
+
+	if (__atomic_fetch_or(&claimed[blk / 64], bit, __ATOMIC_RELAXED) & bit)
+		__atomic_fetch_or(&dupmap[blk / 64], bit, __ATOMIC_RELAXED);
+}
+
+/* Give back the blocks of an inode being freed, unless shared */
+static void unclaim(uint64_t blk)
+{
+	if (!test_bit(dupmap, blk))
+		claimed[blk / 64] &= ~(1ULL << (blk % 64));
+}
+
+/* Why @raw cannot be used as inode @ino, or NULL if it can */
+static const char *inode_problem(uint64_t ino, struct simplefs_inode *raw)
+{
+	struct simplefs_extent_block *eb;
+	struct simplefs_extent *ext;
+	uint16_t type = raw->mode & S_IFMT;
+	uint64_t end = 0;
+	unsigned int i;
+
+	if (raw->inode_no != ino)
+		return "wrong inode number in its slot";
+	if (type != S_IFDIR && type != S_IFREG && type != S_IFLNK)
+		return "unknown file type";
+	if (raw->i_flags & SIMPLEFS_INLINE_DATA_FL) {
+		/* a symlink target keeps its NUL inside i_data */
+		if (type == S_IFDIR || raw->i_extent_count || raw->i_extent_block ||
+		    raw->file_size > SIMPLEFS_INLINE_SIZE - (type == S_IFLNK))
+			return "bad inline data";
+		return NULL;
+	}
+
+	if (raw->i_extent_block) {
+		if (!data_range(raw->i_extent_block, 1))
+			return "extent block out of range";
+		eb = block(raw->i_extent_block);
+		if (raw->i_extent_count > SIMPLEFS_EXTENTS_PER_BLOCK ||
+		    eb->eb_count != raw->i_extent_count)
+			return "bad extent block";
+		ext = eb->eb_extent;
+	} else {
+		if (raw->i_extent_count > SIMPLEFS_INODE_EXTENTS)
+			return "too many extents";
+		ext = raw->i_extent;
+	}
+	for (i = 0; i < raw->i_extent_count; i++) {
+		if (!ext_len(&ext[i]) || ext[i].ee_block < end ||
+		    !data_range(ext[i].ee_start, ext_len(&ext[i])))
+			return "bad extent";
+		end = (uint64_t)ext[i].ee_block + ext_len(&ext[i]);
+	}
+	if (end > UINT32_MAX)
+		return "extent past the largest file";
+	if (type == S_IFLNK && (!raw->file_size ||
+				raw->file_size >= SIMPLEFS_DEFAULT_BLOCK_SIZE ||
+				!raw->i_extent_count || ext[0].ee_block))
+		return "bad symlink";
+	return NULL;
+}
+
+static void pass1_block(struct worker *w, uint64_t index)
+{
+	struct simplefs_inode *raw;
+	struct simplefs_extent *ext;
+	unsigned int i, count;
+	const char *why;
+	uint64_t ino, b;
+	/* free slots the kernel has yet to zero hold stale data */
+	int uninit = sb->itable_uninit && index >= sb->itable_uninit;
+
+	(void)w;	/* run_pass() callback; pass 1 keeps no per-worker state */
+	for (i = 0; i < SIMPLEFS_INODES_PER_BLOCK; i++) {
+		ino = index * SIMPLEFS_INODES_PER_BLOCK + i + SIMPLEFS_ROOTDIR_INODE_NUMBER;
+		raw = raw_inode(ino);
+		if (!raw->inode_no)
+			continue;
+		if (uninit && (ino > sb->max_inodes ||
+			       !test_bit(block(sb->imap_block), ino)))
+			continue;
+		why = inode_problem(ino, raw);
+		if (why) {
+			if (S_ISDIR(raw->mode))
+				__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+			if (report("cleared", "Inode %llu: %s", (unsigned long long)ino, why)) {
+				memset(raw, 0, sizeof(*raw));
+				continue;
+			}
+			istate[ino] = INO_BAD;
+			continue;
+		}
+
+		istate[ino] = INO_USED;
+		if (raw->i_extent_block)
+			claim(raw->i_extent_block);
+		ext = inode_extents(raw, &count);
+		for (; count; count--, ext++) {
+			for (b = 0; b < ext_len(ext); b++)
+				claim(ext->ee_start + b);
+		}
+		if (S_ISDIR(raw->mode))
+			dirs[__atomic_fetch_add(&ndirs, 1, __ATOMIC_RELAXED)] = ino;
+	}
+}
+
+/* One directory being checked by pass 2 */
+struct dir_walk {
+	struct worker *w;
+	uint64_t ino;
+	struct simplefs_extent *ext;
+	unsigned int count;
+	uint32_t nblocks;
+	uint8_t *seen;		/* blocks reached through the index */
+	uint64_t children;
+	int corrupt;
+};
+
+static uint64_t dir_block(struct dir_walk *d, uint32_t lblk)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->count; i++) {
+		if (lblk >= d->ext[i].ee_block &&
+		    lblk - d->ext[i].ee_block < ext_len(&d->ext[i]))
+			return d->ext[i].ee_start + lblk - d->ext[i].ee_block;
+	}
+	return 0;
+}
+
+static void dir_corrupt(struct dir_walk *d, uint32_t lblk, const char *why)
+{
+	if (!d->corrupt)
+		__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+	d->corrupt = 1;
+	report(NULL, "Directory %llu block %u: %s", (unsigned long long)d->ino, lblk, why);
+}
+
+static void add_edge(struct worker *w, uint64_t dir, uint64_t ino)
+{
+	struct edge *edges;
+
+	if (w->nedges == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 1024;
+		edges = realloc(w->edges, w->cap * sizeof(*edges));
+		if (!edges) {
+			w->failed = 1;
+			return;
+		}
+		w->edges = edges;
+	}
+	w->edges[w->nedges].dir = dir;
+	w->edges[w->nedges++].ino = ino;
+}
+
+/*
+ * Check one live record of a leaf whose names hash into [lo, hi).
+ * Returns 0 if the name is to be dropped, which only happens on repair.
+ */
+static int check_name(struct dir_walk *d, struct simplefs_dir_record *rec,
+		uint32_t lo, uint32_t hi)
+{
+	unsigned long long dir = d->ino, ino = rec->inode_no;
+	uint32_t hash = dirhash((unsigned char *)rec->filename, rec->name_len);
+	int len = rec->name_len;
+	uint8_t ftype;
+
+	if (ino < SIMPLEFS_ROOTDIR_INODE_NUMBER || ino > sb->max_inodes ||
+	    ino == SIMPLEFS_ROOTDIR_INODE_NUMBER)
+		return !report("dropped", "Directory %llu: name '%.*s' has bad inode number %llu",
+				dir, len, rec->filename, ino);
+	if (istate[ino] != INO_USED)
+		return !report("dropped", "Directory %llu: name '%.*s' refers to %s inode %llu",
+				dir, len, rec->filename,
+				istate[ino] == INO_BAD ? "damaged" : "free", ino);
+
+	if (hash < lo || hash >= hi) {
+		if (!d->corrupt)
+			__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+		d->corrupt = 1;
+		report(NULL, "Directory %llu: name '%.*s' is in the wrong leaf", dir, len,
+		       rec->filename);
+	}
+	ftype = mode_to_ftype(raw_inode(ino)->mode);
+	if (rec->file_type != ftype &&
+	    report("fixed", "Directory %llu: name '%.*s' has file type %u, not %u",
+		   dir, len, rec->filename, rec->file_type, ftype))
+		rec->file_type = ftype;
+	add_edge(d->w, d->ino, ino);
+	return 1;
+}
+
+static void check_leaf(struct dir_walk *d, uint32_t lblk, uint32_t lo, uint32_t hi)
+{
+	struct simplefs_dir_record *rec, *prev = NULL;
+	uint64_t phys = dir_block(d, lblk);
+	unsigned int offs, len;
+	uint8_t *b;
+
+	if (!phys) {
+		dir_corrupt(d, lblk, "not mapped");
+		return;
+	}
+	b = block(phys);
+
+	/* the records must chain up to the end of the block, as the kernel checks */
+	for (offs = 0; offs < SIMPLEFS_DEFAULT_BLOCK_SIZE; offs += rec->rec_len) {
+		rec = (struct simplefs_dir_record *)(b + offs);
+		if (offs + SIMPLEFS_DIR_REC_LEN(0) > SIMPLEFS_DEFAULT_BLOCK_SIZE ||
+		    rec->rec_len < SIMPLEFS_DIR_REC_LEN(0) || rec->rec_len % 8 ||
+		    rec->rec_len > SIMPLEFS_DEFAULT_BLOCK_SIZE - offs ||
+		    (rec->inode_no && (!rec->name_len ||
+				       SIMPLEFS_DIR_REC_LEN(rec->name_len) > rec->rec_len))) {
+			dir_corrupt(d, lblk, "bad record chain");
+			return;
+		}
+	}
+
+	for (offs = 0; offs < SIMPLEFS_DEFAULT_BLOCK_SIZE; offs += len) {
+		rec = (struct simplefs_dir_record *)(b + offs);
+		len = rec->rec_len;
+		if (!rec->inode_no) {
+			prev = rec;
+			continue;
+		}
+		if (check_name(d, rec, lo, hi)) {
+			d->children++;
+			prev = rec;
+			continue;
+		}
+		/* drop it the way simplefs_delete_entry() does */
+		if (prev)
+			prev->rec_len += len;
+		else
+			rec->inode_no = 0;
+	}
+}
+
+/* Check the index block @lblk, covering hashes [lo, hi), and what is below it */
+static void check_dx(struct dir_walk *d, uint32_t lblk, int levels,
+		uint32_t lo, uint32_t hi)
+{
+	struct simplefs_dx_node *node;
+	uint32_t elo, ehi;
+	uint64_t phys;
+	unsigned int i;
+
+	if (!lblk || lblk >= d->nblocks) {
+		dir_corrupt(d, lblk, "index points outside the directory");
+		return;
+	}
+	if (d->seen[lblk]++) {
+		dir_corrupt(d, lblk, "indexed more than once");
+		return;
+	}
+	if (levels < 0) {
+		check_leaf(d, lblk, lo, hi);
+		return;
+	}
+
+	phys = dir_block(d, lblk);
+	if (!phys) {
+		dir_corrupt(d, lblk, "not mapped");
+		return;
+	}
+	node = block(phys);
+	if (!node->dx_count || node->dx_count > SIMPLEFS_DX_LIMIT) {
+		dir_corrupt(d, lblk, "bad index node");
+		return;
+	}
+	/* the first entry covers everything below the second */
+	for (i = 0; i < node->dx_count; i++) {
+		elo = i ? node->dx_entry[i].hash : lo;
+		ehi = i + 1 < node->dx_count ? node->dx_entry[i + 1].hash : hi;
+		if (elo < lo || ehi > hi || elo > ehi) {
+			dir_corrupt(d, lblk, "index entries out of order");
+			return;
+		}
+	}
+	for (i = 0; i < node->dx_count; i++) {
+		elo = i ? node->dx_entry[i].hash : lo;
+		ehi = i + 1 < node->dx_count ? node->dx_entry[i + 1].hash : hi;
+		check_dx(d, node->dx_entry[i].block, levels - 1, elo, ehi);
+	}
+}
+
+static void pass2_dir(struct worker *w, uint64_t index)
+{
+	struct dir_walk d = { .w = w, .ino = dirs[index] };
+	struct simplefs_inode *raw = raw_inode(d.ino);
+	struct simplefs_dx_node *root;
+	uint64_t end = 0;
+	unsigned int i;
+
+	d.ext = inode_extents(raw, &d.count);
+	for (i = 0; i < d.count; i++)
+		end = (uint64_t)d.ext[i].ee_block + ext_len(&d.ext[i]);
+	d.nblocks = end;
+
+	if (!d.nblocks) {
+		/* never written to */
+	} else if (!(raw->i_flags & SIMPLEFS_INDEX_FL)) {
+		check_leaf(&d, 0, 0, SIMPLEFS_HASH_EOF);
+	} else if (!dir_block(&d, 0)) {
+		dir_corrupt(&d, 0, "not mapped");
+	} else {
+		d.seen = calloc(d.nblocks, 1);
+		if (!d.seen) {
+			w->failed = 1;
+			return;
+		}
+		/* the root is block 0, which check_dx() takes for a bad pointer */
+		d.seen[0] = 1;
+		root = block(dir_block(&d, 0));
+		if (!root->dx_count || root->dx_count > SIMPLEFS_DX_LIMIT ||
+		    root->dx_levels > SIMPLEFS_DX_MAX_LEVELS) {
+			dir_corrupt(&d, 0, "bad index root");
+		} else {
+			for (i = 0; i < root->dx_count; i++) {
+				uint32_t lo = i ? root->dx_entry[i].hash : 0;
+				uint32_t hi = i + 1 < root->dx_count ?
+					root->dx_entry[i + 1].hash : SIMPLEFS_HASH_EOF;
+
+				if (lo > hi) {
+					dir_corrupt(&d, 0, "index entries out of order");
+					break;
+				}
+				check_dx(&d, root->dx_entry[i].block,
+					 root->dx_levels - 1, lo, hi);
+			}
+		}
+		free(d.seen);
+	}
+
+	if (!d.corrupt && raw->dir_children_count != d.children &&
+	    report("fixed", "Directory %llu: child count %llu, should be %llu",
+		   (unsigned long long)d.ino,
+		   (unsigned long long)raw->dir_children_count,
+		   (unsigned long long)d.children))
+		raw->dir_children_count = d.children;
+}
+
+/* Release an unattached inode and its blocks */
+static void free_inode(uint64_t ino)
+{
+	struct simplefs_inode *raw = raw_inode(ino);
+	struct simplefs_extent *ext;
+	unsigned int count;
+	uint64_t b;
+
+	ext = inode_extents(raw, &count);
+	for (; count; count--, ext++) {
+		for (b = 0; b < ext_len(ext); b++)
+			unclaim(ext->ee_start + b);
+	}
+	if (raw->i_extent_block)
+		unclaim(raw->i_extent_block);
+	memset(raw, 0, sizeof(*raw));
+	istate[ino] = INO_FREE;
+}
+
+/*
+ * Walk the tree from the root over the names pass 2 collected, counting
+ * the names each inode has in reachable directories, then fix the link
+ * counts and drop what cannot be reached.
+ */
+static int pass3(struct worker *workers, int nthreads)
+{
+	uint64_t n = sb->max_inodes + 1, nedges = 0, ino, i, head = 0, tail = 0;
+	uint64_t *start, *child, *queue;
+	struct simplefs_inode *raw;
+	uint8_t *reached;
+	int t, err = -1;
+
+	start = calloc(n + 1, sizeof(*start));
+	queue = malloc(n * sizeof(*queue));
+	reached = calloc(n, 1);
+	for (t = 0; t < nthreads; t++)
+		nedges += workers[t].nedges;
+	child = malloc((nedges + 1) * sizeof(*child));
+	if (!start || !queue || !reached || !child)
+		goto out;
+
+	/* group the names by directory */
+	for (t = 0; t < nthreads; t++) {
+		for (i = 0; i < workers[t].nedges; i++)
+			start[workers[t].edges[i].dir + 1]++;
+	}
+	for (ino = 1; ino <= n; ino++)
+		start[ino] += start[ino - 1];
+	for (t = 0; t < nthreads; t++) {
+		for (i = 0; i < workers[t].nedges; i++)
+			child[start[workers[t].edges[i].dir]++] = workers[t].edges[i].ino;
+	}
+	for (ino = n; ino; ino--)
+		start[ino] = start[ino - 1];
+	start[0] = 0;
+
+	reached[SIMPLEFS_ROOTDIR_INODE_NUMBER] = 1;
+	queue[tail++] = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	while (head < tail) {
+		ino = queue[head++];
+		for (i = start[ino]; i < start[ino + 1]; i++) {
+			refs[child[i]]++;
+			if (reached[child[i]])
+				continue;
+			reached[child[i]] = 1;
+			if (S_ISDIR(raw_inode(child[i])->mode))
+				queue[tail++] = child[i];
+		}
+	}
+
+	for (ino = SIMPLEFS_ROOTDIR_INODE_NUMBER; ino < n; ino++) {
+		if (istate[ino] != INO_USED)
+			continue;
+		raw = raw_inode(ino);
+		if (!reached[ino]) {
+			if (lost) {
+				report(NULL, "Inode %llu is unattached, kept as its name may be in a damaged directory",
+				       (unsigned long long)ino);
+				continue;
+			}
+			if (report("freed", "Inode %llu is unattached", (unsigned long long)ino))
+				free_inode(ino);
+			continue;
+		}
+		/* the root has no name and a link count of 1 */
+		if (ino == SIMPLEFS_ROOTDIR_INODE_NUMBER)
+			refs[ino] = 1;
+		if (S_ISDIR(raw->mode) && refs[ino] > 1) {
+			report(NULL, "Directory %llu has %u names", (unsigned long long)ino, refs[ino]);
+			continue;
+		}
+		if (raw->i_nlink != refs[ino] &&
+		    report("fixed", "Inode %llu: link count %u, should be %u",
+			   (unsigned long long)ino, raw->i_nlink, refs[ino]))
+			raw->i_nlink = refs[ino];
+	}
+	err = 0;
+out:
+	free(start);
+	free(queue);
+	free(reached);
+	free(child);
+	return err;
+}
+
+/*
+ * Compare the on-disk bitmap at @blk with the bits @used says are taken,
+ * bits past @nbits being always set.  Returns the number of bits taken.
+ */
+static uint64_t check_bitmap(uint64_t blk, uint64_t blocks, uint64_t nbits,
+		int (*used)(uint64_t), const char *what)
+{
+	uint8_t *map = block(blk);
+	uint64_t i, nr_used = 0, total = blocks * SIMPLEFS_DEFAULT_BLOCK_SIZE * 8;
+	unsigned long wrong = 0;
+	int want, have;
+
+	for (i = 0; i < total; i++) {
+		want = i >= nbits || used(i);
+		have = (map[i / 8] >> (i % 8)) & 1;
+		if (i < nbits)
+			nr_used += want;
+		if (want == have)
+			continue;
+		if (wrong++ < MAX_DUP_REPORT)
+			printf("%s %llu is %s in the bitmap\n", what, (unsigned long long)i,
+			       want ? "in use but marked free" : "free but marked in use");
+		if (repair)
+			map[i / 8] ^= 1 << (i % 8);
+	}
+	if (wrong)
+		report("rewritten", "%s bitmap differs in %lu bits", what, wrong);
+	return nr_used;
+}
+
+/* damaged inodes keep their bit until cleared */
+static int inode_used(uint64_t ino)
+{
+	return !ino || istate[ino] != INO_FREE;
+}
+
+static int block_used(uint64_t blk)
+{
+	return blk < sb->data_block || test_bit(claimed, blk);
+}
+
+static void report_dups(void)
+{
+	unsigned long n = 0;
+	uint64_t b;
+
+	for (b = sb->data_block; b < sb->blocks_count; b++) {
+		if (!test_bit(dupmap, b))
+			continue;
+		if (n++ < MAX_DUP_REPORT)
+			printf("Block %llu is owned by more than one inode\n",
+			       (unsigned long long)b);
+	}
+	if (n)
+		report(NULL, "%lu blocks owned more than once", n);
+}
+
+static int check_super(uint64_t size)
+{
+	uint64_t bits = SIMPLEFS_DEFAULT_BLOCK_SIZE * 8;
+
+	if (sb->magic != SIMPLEFS_MAGIC) {
+		printf("Not a simplefs image\n");
+		return -1;
+	}
+	if (sb->version != SIMPLEFS_VERSION || sb->block_size != SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+		printf("Unsupported version %llu or block size %llu\n",
+		       (unsigned long long)sb->version, (unsigned long long)sb->block_size);
+		return -1;
+	}
+	if (sb->imap_block != SIMPLEFS_IMAP_BLOCK_NUMBER ||
+	    sb->dmap_block != sb->imap_block + sb->imap_blocks ||
+	    sb->inodestore_block != sb->dmap_block + sb->dmap_blocks ||
+	    sb->journal_block != sb->inodestore_block + sb->inodestore_blocks ||
+	    sb->data_block != sb->journal_block + sb->journal_blocks ||
+	    sb->data_block >= sb->blocks_count ||
+	    sb->max_inodes < SIMPLEFS_ROOTDIR_INODE_NUMBER ||
+	    sb->max_inodes > sb->inodestore_blocks * SIMPLEFS_INODES_PER_BLOCK ||
+	    sb->imap_blocks * bits < sb->max_inodes + 1 ||
+	    sb->dmap_blocks * bits < sb->blocks_count ||
+	    sb->itable_uninit >= sb->inodestore_blocks ||
+	    (sb->blocks_per_group && (sb->blocks_per_group < SIMPLEFS_MIN_BLOCKS_PER_GROUP ||
+				      sb->blocks_per_group > SIMPLEFS_MAX_BLOCKS_PER_GROUP ||
+				      (sb->blocks_per_group & (sb->blocks_per_group - 1))))) {
+		printf("The super block layout is inconsistent\n");
+		return -1;
+	}
+	if (sb->blocks_count > size / SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+		printf("The image is shorter than the %llu blocks of the filesystem\n",
+		       (unsigned long long)sb->blocks_count);
+		return -1;
+	}
+	return 0;
+}
+
+/* A log with s_start set still holds transactions the kernel replays at mount */
+static int journal_dirty(void)
+{
+	uint32_t *jsb;
+
+	if (!sb->journal_blocks)
+		return 0;
+	jsb = block(sb->journal_block);
+	/* h_magic and s_start, big endian */
+	return ntohl(jsb[0]) == JBD2_MAGIC_NUMBER && ntohl(jsb[7]);
+}
+
+static int device_size(int fd, uint64_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1) {
+		perror("Error querying the device");
+		return -1;
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size) == -1) {
+			perror("Error querying the device size");
+			return -1;
+		}
+		return 0;
+	}
+	*size = st.st_size;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker workers[SIMPLEFS_MAX_THREADS] = { { 0 } };
+	int fd, opt, t, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t size, len, used_inodes, used_blocks;
+	struct simplefs_super_block *s;
+	int ret = FSCK_ERROR;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "nyt:")) != -1) {
+		switch (opt) {
+		case 'n':
+			repair = 0;
+			break;
+		case 'y':
+			repair = 1;
+			break;
+		case 't':
+			nthreads = strtol(optarg, &end, 0);
+			if (*end || nthreads < 1) {
+				printf("Bad thread count %s\n", optarg);
+				return FSCK_ERROR;
+			}
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		printf("Usage: fsck-simplefs [-n | -y] [-t threads] <device>\n");
+		return FSCK_ERROR;
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > SIMPLEFS_MAX_THREADS)
+		nthreads = SIMPLEFS_MAX_THREADS;
+
+	fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+	if (device_size(fd, &size))
+		goto out_close;
+	if (size < SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+		printf("Not a simplefs image\n");
+		goto out_close;
+	}
+	s = mmap(NULL, SIMPLEFS_DEFAULT_BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (s == MAP_FAILED) {
+		perror("Error mapping the super block");
+		goto out_close;
+	}
+	sb = s;
+	if (check_super(size)) {
+		munmap(s, SIMPLEFS_DEFAULT_BLOCK_SIZE);
+		goto out_close;
+	}
+	len = sb->blocks_count * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	munmap(s, SIMPLEFS_DEFAULT_BLOCK_SIZE);
+
+	image = mmap(NULL, len, repair ? PROT_READ | PROT_WRITE : PROT_READ,
+		     MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED) {
+		perror("Error mapping the image");
+		goto out_close;
+	}
+	sb = (struct simplefs_super_block *)image;
+	/* bitmaps, inode table and the first directory blocks, in big reads */
+	madvise(image, (sb->data_block + 1) * SIMPLEFS_DEFAULT_BLOCK_SIZE, MADV_WILLNEED);
+
+	if (journal_dirty()) {
+		printf("The journal needs recovery: mount the filesystem once to replay it\n");
+		if (repair) {
+			ret = FSCK_UNCORRECTED;
+			goto out_unmap;
+		}
+	}
+
+	istate = calloc(sb->max_inodes + 1, 1);
+	refs = calloc(sb->max_inodes + 1, sizeof(*refs));
+	dirs = malloc((sb->max_inodes + 1) * sizeof(*dirs));
+	claimed = calloc(sb->blocks_count / 64 + 1, sizeof(*claimed));
+	dupmap = calloc(sb->blocks_count / 64 + 1, sizeof(*dupmap));
+	if (!istate || !refs || !dirs || !claimed || !dupmap) {
+		printf("Out of memory\n");
+		goto out_free;
+	}
+
+	printf("Pass 1: checking inodes and blocks\n");
+	if (run_pass(workers, nthreads, pass1_block, sb->inodestore_blocks, ITABLE_CHUNK))
+		goto out_free;
+	if (istate[SIMPLEFS_ROOTDIR_INODE_NUMBER] != INO_USED ||
+	    !S_ISDIR(raw_inode(SIMPLEFS_ROOTDIR_INODE_NUMBER)->mode)) {
+		printf("The root directory is missing\n");
+		ret = FSCK_UNCORRECTED;
+		goto out_free;
+	}
+	report_dups();
+
+	printf("Pass 2: checking directories\n");
+	if (run_pass(workers, nthreads, pass2_dir, ndirs, DIR_CHUNK)) {
+		printf("Out of memory\n");
+		goto out_free;
+	}
+
+	printf("Pass 3: checking connectivity and link counts\n");
+	if (pass3(workers, nthreads)) {
+		printf("Out of memory\n");
+		goto out_free;
+	}
+
+	printf("Pass 4: checking bitmaps\n");
+	used_inodes = check_bitmap(sb->imap_block, sb->imap_blocks, sb->max_inodes + 1,
+				   inode_used, "Inode") - 1;
+	used_blocks = check_bitmap(sb->dmap_block, sb->dmap_blocks, sb->blocks_count,
+				   block_used, "Block");
+
+	/* the kernel recounts these at mount, so they are fixed without a word */
+	if (repair) {
+		sb->inodes_count = used_inodes;
+		sb->free_inodes = sb->max_inodes - used_inodes;
+		sb->free_blocks = sb->blocks_count - used_blocks;
+		if (msync(image, len, MS_SYNC) || fsync(fd)) {
+			perror("Error writing the repairs");
+			goto out_free;
+		}
+	}
+
+	printf("%s: %llu/%llu inodes, %llu/%llu blocks\n", argv[optind],
+	       (unsigned long long)used_inodes, (unsigned long long)sb->max_inodes,
+	       (unsigned long long)used_blocks, (unsigned long long)sb->blocks_count);
+	ret = errors ? FSCK_UNCORRECTED : fixed ? FSCK_FIXED : FSCK_OK;
+
+out_free:
+	for (t = 0; t < nthreads; t++)
+		free(workers[t].edges);
+	free(istate);
+	free(refs);
+	free(dirs);
+	free(claimed);
+	free(dupmap);
+out_unmap:
+	munmap(image, len);
+out_close:
+	close(fd);
+	return ret;
+}
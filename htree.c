@@ -0,0 +1,907 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/blkdev.h>
+#include <linux/fs_types.h>
+#include <linux/compat.h>
+#include "simple.h"
+#include "trace.h"
+
+/*
+ * A small directory is a single leaf block of variable-length
+ * simplefs_dir_record entries, packed as in ext2: a new name goes into the
+ * slack after an entry or into a free one, and a deleted entry is merged
+ * into the one before it.  When that block has no room left, block 0
+ * becomes the root of a hash index and the records move to leaf blocks
+ * found through it.  The root has at most SIMPLEFS_DX_MAX_LEVELS levels of
+ * index nodes below it, and names sharing a hash never straddle two
+ * leaves, so a lookup reads one block per index level plus one leaf.
+ *
+ * readdir walks the leaves in hash order, names sharing a hash in name
+ * order.  The directory cookie is the hash in its high bits and the rank
+ * of the name among those sharing the hash in its low SIMPLEFS_POS_BITS;
+ * leaf splits move names around but never change either.  Callers that
+ * can only take 32-bit cookies get the bare hash, and resume at the start
+ * of a group of colliding names.  One probe positions readdir at the leaf
+ * for the cookie, after which it steps through the index blocks it holds
+ * and reads the following leaves ahead.
+ */
+
+/* Low bits of a directory cookie holding the rank within a hash group */
+#define SIMPLEFS_POS_BITS 32
+
+/* Leaves read ahead at a time by readdir */
+#define SIMPLEFS_DIR_RA_BLOCKS 8
+
+/* Hash and offset of a leaf record, for sorting a leaf by hash */
+struct simplefs_dx_map {
+	uint32_t hash;
+	uint32_t offs;
+};
+
+/* One index block on the path from the root to a leaf */
+struct simplefs_dx_frame {
+	struct buffer_head *bh;
+	struct simplefs_dx_node *node;
+	unsigned int at;	/* entry covering the hash looked up */
+	unsigned int ra;	/* first entry not read ahead yet */
+};
+
+static uint32_t simplefs_dirhash(const unsigned char *name, int len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *name++;
+		hash *= 0x01000193;
+	}
+	return hash % SIMPLEFS_HASH_EOF;
+}
+
+static inline uint32_t simplefs_rec_hash(struct simplefs_dir_record *rec)
+{
+	return simplefs_dirhash(rec->filename, rec->name_len);
+}
+
+static inline int simplefs_namecmp(int len, const unsigned char *name,
+		struct simplefs_dir_record *rec)
+{
+	return len == rec->name_len && !memcmp(name, rec->filename, len);
+}
+
+static inline struct simplefs_dir_record *simplefs_next_rec(struct simplefs_dir_record *rec)
+{
+	return (struct simplefs_dir_record *)((char *)rec + rec->rec_len);
+}
+
+static inline bool simplefs_leaf_end(struct buffer_head *bh, struct simplefs_dir_record *rec)
+{
+	return (char *)rec >= bh->b_data + bh->b_size;
+}
+
+/* Make @bh an empty leaf: one free record spanning the block */
+static void simplefs_leaf_init(struct buffer_head *bh)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->rec_len = bh->b_size;
+}
+
+static int simplefs_dx_cmp(const void *a, const void *b)
+{
+	const struct simplefs_dx_map *x = a, *y = b;
+
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static struct buffer_head *simplefs_dir_bread(struct inode *dir, sector_t iblock)
+{
+	unsigned int len = 1;
+	sector_t phys;
+
+	if (simplefs_map_blocks(dir, iblock, &len, &phys, 0) < 0 || !phys)
+		return NULL;
+	return sb_bread(dir->i_sb, phys);
+}
+
+/*
+ * Read a leaf and check that its records chain up to the end of the
+ * block, so that the walks below can follow rec_len blindly.
+ */
+static struct buffer_head *simplefs_leaf_bread(struct inode *dir, sector_t iblock)
+{
+	struct simplefs_dir_record *rec;
+	struct buffer_head *bh;
+	unsigned int offs = 0;
+
+	bh = simplefs_dir_bread(dir, iblock);
+	if (!bh)
+		return NULL;
+	while (offs < bh->b_size) {
+		rec = (struct simplefs_dir_record *)(bh->b_data + offs);
+		if (offs + SIMPLEFS_DIR_REC_LEN(0) > bh->b_size ||
+		    rec->rec_len < SIMPLEFS_DIR_REC_LEN(0) || rec->rec_len % 8 ||
+		    rec->rec_len > bh->b_size - offs ||
+		    (rec->inode_no && (!rec->name_len ||
+				       SIMPLEFS_DIR_REC_LEN(rec->name_len) > rec->rec_len))) {
+			printk(KERN_ERR "simplefs: corrupt directory block %s:%lu:%llu\n",
+					dir->i_sb->s_id, dir->i_ino, (unsigned long long)iblock);
+			brelse(bh);
+			return NULL;
+		}
+		offs += rec->rec_len;
+	}
+	return bh;
+}
+
+/* Add a zeroed block at the end of the directory */
+static struct buffer_head *simplefs_dir_append(struct inode *dir, uint32_t *iblock)
+{
+	sector_t blk = dir->i_size >> dir->i_blkbits;
+	struct buffer_head *bh;
+	unsigned int len = 1;
+	sector_t phys;
+	int ret;
+
+	ret = simplefs_map_blocks(dir, blk, &len, &phys, SIMPLEFS_MAP_CREATE);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	bh = sb_getblk(dir->i_sb, phys);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	lock_buffer(bh);
+	ret = simplefs_get_create_access(bh);
+	if (ret) {
+		unlock_buffer(bh);
+		brelse(bh);
+		return ERR_PTR(ret);
+	}
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	simplefs_dirty_metadata(bh, dir);
+
+	dir->i_size += dir->i_sb->s_blocksize;
+	mark_inode_dirty(dir);
+	*iblock = blk;
+	return bh;
+}
+
+/*
+ * Directory blocks go out with the inode's fsync, or right away on dirsync.
+ * Callers take simplefs_get_write_access() before changing the block.
+ */
+static void simplefs_dir_write(struct buffer_head *bh, struct inode *dir)
+{
+	simplefs_dirty_metadata(bh, dir);
+	if (IS_DIRSYNC(dir))
+		simplefs_sync_metadata(bh);
+}
+
+static void simplefs_dx_release(struct simplefs_dx_frame *frames, int n)
+{
+	while (n--)
+		brelse(frames[n].bh);
+}
+
+static inline uint32_t simplefs_dx_leaf(struct simplefs_dx_frame *frames, int n)
+{
+	return frames[n - 1].node->dx_entry[frames[n - 1].at].block;
+}
+
+/* Hash where the leaf after the one found by simplefs_dx_probe() starts */
+static uint32_t simplefs_dx_next_hash(struct simplefs_dx_frame *frames, int n)
+{
+	while (n--) {
+		if (frames[n].at + 1 < frames[n].node->dx_count)
+			return frames[n].node->dx_entry[frames[n].at + 1].hash;
+	}
+	return SIMPLEFS_HASH_EOF;
+}
+
+/*
+ * Walk the index from the root to the leaf covering @hash, filling one
+ * frame per index block.  Returns the number of frames or -EIO.
+ */
+static int simplefs_dx_probe(struct inode *dir, uint32_t hash,
+		struct simplefs_dx_frame *frames)
+{
+	uint32_t nblocks = dir->i_size >> dir->i_blkbits;
+	struct simplefs_dx_frame *frame;
+	struct simplefs_dx_node *node;
+	uint32_t block = 0;
+	int level = 0, levels = 0;
+	int lo, hi, mid;
+
+	for (;;) {
+		frame = &frames[level];
+		frame->bh = simplefs_dir_bread(dir, block);
+		if (!frame->bh) {
+			simplefs_dx_release(frames, level);
+			return -EIO;
+		}
+		node = frame->node = (struct simplefs_dx_node *)frame->bh->b_data;
+		level++;
+		if (level == 1)
+			levels = node->dx_levels;
+		if (levels > SIMPLEFS_DX_MAX_LEVELS || !node->dx_count ||
+		    node->dx_count > SIMPLEFS_DX_LIMIT)
+			goto corrupt;
+
+		/* the first entry covers everything below the second */
+		lo = 1;
+		hi = node->dx_count - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			if (node->dx_entry[mid].hash <= hash)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+		frame->at = hi;
+		frame->ra = 0;
+
+		block = node->dx_entry[hi].block;
+		if (!block || block >= nblocks)
+			goto corrupt;
+		if (level > levels)
+			return level;
+	}
+
+corrupt:
+	printk(KERN_ERR "simplefs: corrupt directory index %s:%lu\n",
+			dir->i_sb->s_id, dir->i_ino);
+	simplefs_dx_release(frames, level);
+	return -EIO;
+}
+
+/*
+ * Step the frames to the next leaf in hash order, reading index nodes as
+ * needed.  Returns 1 when there is one, 0 at the end, or -EIO.
+ */
+static int simplefs_dx_next(struct inode *dir, struct simplefs_dx_frame *frames, int n)
+{
+	struct simplefs_dx_frame *frame;
+	int level = n - 1;
+	uint32_t block;
+
+	while (frames[level].at + 1 >= frames[level].node->dx_count) {
+		if (!level)
+			return 0;
+		level--;
+	}
+	frames[level].at++;
+
+	while (++level < n) {
+		block = frames[level - 1].node->dx_entry[frames[level - 1].at].block;
+		frame = &frames[level];
+		brelse(frame->bh);
+		frame->bh = simplefs_dir_bread(dir, block);
+		if (!frame->bh)
+			return -EIO;
+		frame->node = (struct simplefs_dx_node *)frame->bh->b_data;
+		frame->at = 0;
+		frame->ra = 0;
+		if (!frame->node->dx_count || frame->node->dx_count > SIMPLEFS_DX_LIMIT) {
+			printk(KERN_ERR "simplefs: corrupt directory index %s:%lu\n",
+					dir->i_sb->s_id, dir->i_ino);
+			return -EIO;
+		}
+	}
+	return 1;
+}
+
+/* Start reading the leaves after the current one, a batch at a time */
+static void simplefs_dx_readahead(struct inode *dir, struct simplefs_dx_frame *frame)
+{
+	struct simplefs_dx_node *node = frame->node;
+	unsigned int i, end, len;
+	sector_t phys;
+
+	if (frame->ra > frame->at + 1)
+		return;
+	end = min_t(unsigned int, node->dx_count, frame->at + 1 + SIMPLEFS_DIR_RA_BLOCKS);
+	for (i = frame->at + 1; i < end; i++) {
+		len = 1;
+		if (simplefs_map_blocks(dir, node->dx_entry[i].block, &len, &phys, 0) || !phys)
+			break;
+		sb_breadahead(dir->i_sb, phys);
+	}
+	frame->ra = end;
+}
+
+/* *scanned counts the records looked at, for the find_entry tracepoint */
+static struct simplefs_dir_record *simplefs_leaf_find(struct buffer_head *bh,
+		const unsigned char *name, int len, unsigned int *scanned)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+
+	for (*scanned = 0; !simplefs_leaf_end(bh, rec); rec = simplefs_next_rec(rec)) {
+		++*scanned;
+		if (rec->inode_no && simplefs_namecmp(len, name, rec))
+			return rec;
+	}
+	return NULL;
+}
+
+/* Bytes of a record not taken by its name */
+static inline unsigned int simplefs_rec_slack(struct simplefs_dir_record *rec)
+{
+	if (!rec->inode_no)
+		return rec->rec_len;
+	return rec->rec_len - SIMPLEFS_DIR_REC_LEN(rec->name_len);
+}
+
+/* The first record with room for a @len byte name after its own */
+static struct simplefs_dir_record *simplefs_leaf_room(struct buffer_head *bh, int len)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+
+	for (; !simplefs_leaf_end(bh, rec); rec = simplefs_next_rec(rec)) {
+		if (simplefs_rec_slack(rec) >= SIMPLEFS_DIR_REC_LEN(len))
+			return rec;
+	}
+	return NULL;
+}
+
+/*
+ * Pack the records of @from listed in @map into the leaf @to, in @map
+ * order, the last one taking the rest of the block.
+ */
+static void simplefs_leaf_pack(char *to, const char *from, unsigned int size,
+		struct simplefs_dx_map *map, int n)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)to;
+	const struct simplefs_dir_record *src;
+	unsigned int offs = 0, len;
+	int i;
+
+	memset(to, 0, size);
+	for (i = 0; i < n; i++) {
+		src = (const struct simplefs_dir_record *)(from + map[i].offs);
+		rec = (struct simplefs_dir_record *)(to + offs);
+		len = SIMPLEFS_DIR_REC_LEN(src->name_len);
+		memcpy(rec, src, len);
+		rec->rec_len = len;
+		offs += len;
+	}
+	rec->rec_len += size - offs;
+}
+
+/* Turn a full linear directory into an indexed one with a single leaf */
+static int simplefs_dx_create(struct inode *dir, struct buffer_head *root)
+{
+	struct simplefs_dx_node *node;
+	struct buffer_head *leaf;
+	uint32_t block;
+	int err;
+
+	err = simplefs_get_write_access(root);
+	if (err)
+		return err;
+	leaf = simplefs_dir_append(dir, &block);
+	if (IS_ERR(leaf))
+		return PTR_ERR(leaf);
+	memcpy(leaf->b_data, root->b_data, leaf->b_size);
+	simplefs_dir_write(leaf, dir);
+	brelse(leaf);
+
+	memset(root->b_data, 0, root->b_size);
+	node = (struct simplefs_dx_node *)root->b_data;
+	node->dx_count = 1;
+	node->dx_entry[0].block = block;
+	simplefs_dir_write(root, dir);
+
+	simplefs_i(dir)->i_flags |= SIMPLEFS_INDEX_FL;
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/* Insert (hash, block) right after entry @at of an index block */
+static void simplefs_dx_insert(struct simplefs_dx_node *node, unsigned int at,
+		uint32_t hash, uint32_t block)
+{
+	struct simplefs_dx_entry *entry = &node->dx_entry[at + 1];
+
+	memmove(entry + 1, entry, (node->dx_count - at - 1) * sizeof(*entry));
+	entry->hash = hash;
+	entry->block = block;
+	node->dx_count++;
+}
+
+/*
+ * The index block above a leaf that must split is full.  Either push the
+ * root entries down into a new index node, or split an index node in two
+ * and index the new half in the root.  The caller probes again afterwards.
+ */
+static int simplefs_dx_grow(struct inode *dir, struct simplefs_dx_frame *frames, int n)
+{
+	struct simplefs_dx_node *root = frames[0].node, *node, *new;
+	struct buffer_head *bh;
+	unsigned int half;
+	uint32_t block;
+	int i, err;
+
+	for (i = 0; i < n; i++) {
+		err = simplefs_get_write_access(frames[i].bh);
+		if (err)
+			return err;
+	}
+
+	if (n == 1) {
+		bh = simplefs_dir_append(dir, &block);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		memcpy(bh->b_data, root, bh->b_size);
+		simplefs_dir_write(bh, dir);
+		brelse(bh);
+
+		root->dx_levels = 1;
+		root->dx_count = 1;
+		root->dx_entry[0].block = block;
+		simplefs_dir_write(frames[0].bh, dir);
+		return 0;
+	}
+
+	if (root->dx_count == SIMPLEFS_DX_LIMIT)
+		return -ENOSPC;
+
+	bh = simplefs_dir_append(dir, &block);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	node = frames[1].node;
+	new = (struct simplefs_dx_node *)bh->b_data;
+	half = node->dx_count / 2;
+	new->dx_count = node->dx_count - half;
+	memcpy(new->dx_entry, &node->dx_entry[half],
+	       new->dx_count * sizeof(struct simplefs_dx_entry));
+	simplefs_dir_write(bh, dir);
+
+	memset(&node->dx_entry[half], 0, new->dx_count * sizeof(struct simplefs_dx_entry));
+	node->dx_count = half;
+	simplefs_dir_write(frames[1].bh, dir);
+
+	simplefs_dx_insert(root, frames[0].at, new->dx_entry[0].hash, block);
+	simplefs_dir_write(frames[0].bh, dir);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Move the upper half of the full leaf @bh, by hash, to a new block indexed
+ * from @frame, which has room.  Returns the half that covers @hash.
+ */
+static struct buffer_head *simplefs_dx_split(struct inode *dir,
+		struct simplefs_dx_frame *frame, struct buffer_head *bh, uint32_t hash)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+	struct buffer_head *new = ERR_PTR(-ENOMEM);
+	struct simplefs_dx_map *map;
+	unsigned int used = 0, half = 0;
+	int i, n = 0, split, err;
+	uint32_t block, split_hash;
+	char *old;
+
+	map = kmalloc_array(SIMPLEFS_DIR_RECORDS_PER_BLOCK, sizeof(*map), GFP_NOFS);
+	old = kmalloc(bh->b_size, GFP_NOFS);
+	if (!map || !old)
+		goto out;
+	for (; !simplefs_leaf_end(bh, rec); rec = simplefs_next_rec(rec)) {
+		if (!rec->inode_no)
+			continue;
+		map[n].hash = simplefs_rec_hash(rec);
+		map[n++].offs = (char *)rec - bh->b_data;
+		used += SIMPLEFS_DIR_REC_LEN(rec->name_len);
+	}
+	new = ERR_PTR(-ENOSPC);
+	if (n < 2)
+		goto out;
+	sort(map, n, sizeof(*map), simplefs_dx_cmp, NULL);
+
+	/* the middle by bytes, as names vary in length */
+	for (split = 0; split < n - 1 && half < used / 2; split++) {
+		rec = (struct simplefs_dir_record *)(bh->b_data + map[split].offs);
+		half += SIMPLEFS_DIR_REC_LEN(rec->name_len);
+	}
+	if (!split)
+		split = 1;
+
+	/* keep names sharing a hash together, on either side of the middle */
+	for (i = split; split < n; split++) {
+		if (map[split].hash != map[split - 1].hash)
+			break;
+	}
+	if (split == n) {
+		for (split = i; split > 0; split--) {
+			if (map[split].hash != map[split - 1].hash)
+				break;
+		}
+	}
+	if (!split)
+		goto out;
+	split_hash = map[split].hash;
+
+	err = simplefs_get_write_access(bh);
+	if (!err)
+		err = simplefs_get_write_access(frame->bh);
+	if (err) {
+		new = ERR_PTR(err);
+		goto out;
+	}
+	new = simplefs_dir_append(dir, &block);
+	if (IS_ERR(new))
+		goto out;
+	memcpy(old, bh->b_data, bh->b_size);
+	simplefs_leaf_pack(new->b_data, old, new->b_size, map + split, n - split);
+	simplefs_leaf_pack(bh->b_data, old, bh->b_size, map, split);
+
+	simplefs_dir_write(new, dir);
+	simplefs_dir_write(bh, dir);
+	simplefs_dx_insert(frame->node, frame->at, split_hash, block);
+	simplefs_dir_write(frame->bh, dir);
+
+	if (hash >= split_hash) {
+		brelse(bh);
+	} else {
+		brelse(new);
+		new = bh;
+	}
+out:
+	if (IS_ERR(new))
+		brelse(bh);
+	kfree(map);
+	kfree(old);
+	return new;
+}
+
+/* Read the leaf that should receive a @len byte name hashing to @hash, making room */
+static struct buffer_head *simplefs_dx_leaf_for(struct inode *dir, uint32_t hash, int len)
+{
+	struct simplefs_dx_frame frames[SIMPLEFS_DX_MAX_LEVELS + 1];
+	struct buffer_head *bh;
+	int n, err;
+
+	for (;;) {
+		n = simplefs_dx_probe(dir, hash, frames);
+		if (n < 0)
+			return ERR_PTR(n);
+		bh = simplefs_leaf_bread(dir, simplefs_dx_leaf(frames, n));
+		if (!bh) {
+			bh = ERR_PTR(-EIO);
+			break;
+		}
+		if (simplefs_leaf_room(bh, len))
+			break;
+		if (frames[n - 1].node->dx_count < SIMPLEFS_DX_LIMIT) {
+			bh = simplefs_dx_split(dir, &frames[n - 1], bh, hash);
+			break;
+		}
+		brelse(bh);
+		err = simplefs_dx_grow(dir, frames, n);
+		simplefs_dx_release(frames, n);
+		if (err)
+			return ERR_PTR(err);
+	}
+	simplefs_dx_release(frames, n);
+	return bh;
+}
+
+struct buffer_head *simplefs_find_entry(struct inode *dir,
+		const struct qstr *child,
+		struct simplefs_dir_record **res_dir)
+{
+	struct simplefs_dx_frame frames[SIMPLEFS_DX_MAX_LEVELS + 1];
+	struct simplefs_inode_info *sinfo = simplefs_i(dir);
+	struct buffer_head *bh;
+	uint32_t block = 0;
+	unsigned int scanned;
+	int n;
+
+	*res_dir = NULL;
+	if (child->len > SIMPLEFS_FILENAME_MAXLEN)
+		return NULL;
+
+	if (!sinfo->dir_children_count)
+		return NULL;
+
+	if (sinfo->i_flags & SIMPLEFS_INDEX_FL) {
+		n = simplefs_dx_probe(dir, simplefs_dirhash(child->name, child->len), frames);
+		if (n < 0)
+			return NULL;
+		block = simplefs_dx_leaf(frames, n);
+		simplefs_dx_release(frames, n);
+	}
+
+	bh = simplefs_leaf_bread(dir, block);
+	if (!bh)
+		return NULL;
+	*res_dir = simplefs_leaf_find(bh, child->name, child->len, &scanned);
+	trace_simplefs_find_entry(dir, child->name, child->len, block, scanned,
+			*res_dir ? (unsigned long)(*res_dir)->inode_no : 0);
+	if (!*res_dir) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+static int simplefs_do_add_entry(struct inode *dir, const struct qstr *child,
+		struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(dir);
+	struct simplefs_dir_record *drecord, *next;
+	struct buffer_head *bh = NULL;
+	unsigned int len;
+	uint32_t block;
+	int err;
+
+	if (!child->len)
+		return -ENOENT;
+	if (child->len > SIMPLEFS_FILENAME_MAXLEN)
+		return -ENAMETOOLONG;
+
+	if (!dir->i_size) {
+		bh = simplefs_dir_append(dir, &block);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+		simplefs_leaf_init(bh);
+	} else if (!(sinfo->i_flags & SIMPLEFS_INDEX_FL)) {
+		bh = simplefs_leaf_bread(dir, 0);
+		if (!bh)
+			return -EIO;
+		if (!simplefs_leaf_room(bh, child->len)) {
+			err = simplefs_dx_create(dir, bh);
+			brelse(bh);
+			if (err)
+				return err;
+			bh = NULL;
+		}
+	}
+	if (!bh) {
+		bh = simplefs_dx_leaf_for(dir, simplefs_dirhash(child->name, child->len),
+				child->len);
+		if (IS_ERR(bh))
+			return PTR_ERR(bh);
+	}
+
+	drecord = simplefs_leaf_room(bh, child->len);
+	err = drecord ? simplefs_get_write_access(bh) : -ENOSPC;
+	if (err) {
+		brelse(bh);
+		return err;
+	}
+	/* take the slack after a live record, or the whole free one */
+	if (drecord->inode_no) {
+		len = SIMPLEFS_DIR_REC_LEN(drecord->name_len);
+		next = (struct simplefs_dir_record *)((char *)drecord + len);
+		next->rec_len = drecord->rec_len - len;
+		drecord->rec_len = len;
+		drecord = next;
+	}
+	drecord->inode_no = inode->i_ino;
+	drecord->name_len = child->len;
+	drecord->file_type = fs_umode_to_ftype(inode->i_mode);
+	memcpy(drecord->filename, child->name, child->len);
+	simplefs_dir_write(bh, dir);
+	brelse(bh);
+
+	sinfo->dir_children_count++;
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+int simplefs_add_entry(struct inode *dir, const struct qstr *child,
+		struct inode *inode)
+{
+	int err = simplefs_do_add_entry(dir, child, inode);
+
+	trace_simplefs_add_entry(dir, child->name, child->len, inode->i_ino, err);
+	return err;
+}
+
+int simplefs_delete_entry(struct buffer_head *bh, struct inode *dir,
+		struct simplefs_dir_record *drecord)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(dir);
+	struct simplefs_dir_record *prev = NULL;
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+	int err;
+
+	for (; rec != drecord; rec = simplefs_next_rec(rec))
+		prev = rec;
+	err = simplefs_get_write_access(bh);
+	trace_simplefs_delete_entry(dir, drecord->filename, drecord->name_len,
+			drecord->inode_no, err);
+	if (err)
+		return err;
+	/* the previous record absorbs it; the first one of a block goes free */
+	if (prev)
+		prev->rec_len += drecord->rec_len;
+	else
+		drecord->inode_no = 0;
+	simplefs_dir_write(bh, dir);
+
+	sinfo->dir_children_count--;
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
+/* Cookie bits below the hash: none for callers limited to 32-bit offsets */
+static unsigned int simplefs_pos_bits(struct file *file)
+{
+	if (file->f_mode & FMODE_32BITHASH)
+		return 0;
+	if (file->f_mode & FMODE_64BITHASH)
+		return SIMPLEFS_POS_BITS;
+	return in_compat_syscall() || BITS_PER_LONG == 32 ? 0 : SIMPLEFS_POS_BITS;
+}
+
+static inline loff_t simplefs_dir_pos(uint32_t hash, uint32_t rank, unsigned int bits)
+{
+	return ((loff_t)hash << bits) | (bits ? rank : 0);
+}
+
+static int simplefs_rec_cmp(struct buffer_head *bh, const struct simplefs_dx_map *a,
+		const struct simplefs_dx_map *b)
+{
+	struct simplefs_dir_record *x = (struct simplefs_dir_record *)(bh->b_data + a->offs);
+	struct simplefs_dir_record *y = (struct simplefs_dir_record *)(bh->b_data + b->offs);
+	int c = memcmp(x->filename, y->filename, min(x->name_len, y->name_len));
+
+	return c ? c : x->name_len - y->name_len;
+}
+
+/* Put the names sharing a hash, in a map sorted by hash, in name order */
+static void simplefs_sort_groups(struct buffer_head *bh, struct simplefs_dx_map *map, int n)
+{
+	struct simplefs_dx_map tmp;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		tmp = map[i];
+		for (j = i; j > 0 && map[j - 1].hash == tmp.hash &&
+		     simplefs_rec_cmp(bh, &map[j - 1], &tmp) > 0; j--)
+			map[j] = map[j - 1];
+		map[j] = tmp;
+	}
+}
+
+/*
+ * Emit the names of one leaf from the cookie in ctx->pos on.  ctx->pos is
+ * set to the cookie of each name before it is emitted, so a caller that
+ * runs out of room resumes at the first name it did not take.
+ */
+static bool simplefs_leaf_emit(struct inode *dir, struct buffer_head *bh,
+		struct dir_context *ctx, struct simplefs_dx_map *map, int plus,
+		unsigned int bits)
+{
+	struct simplefs_dir_record *rec = (struct simplefs_dir_record *)bh->b_data;
+	uint32_t start = ctx->pos >> bits, skip, rank = 0, hash;
+	struct blk_plug plug;
+	struct inode *inode;
+	int i, n = 0;
+
+	skip = bits ? (uint32_t)ctx->pos : 0;
+	for (; !simplefs_leaf_end(bh, rec); rec = simplefs_next_rec(rec)) {
+		if (!rec->inode_no)
+			continue;
+		hash = simplefs_rec_hash(rec);
+		if (hash >= start) {
+			map[n].hash = hash;
+			map[n++].offs = (char *)rec - bh->b_data;
+		}
+	}
+	sort(map, n, sizeof(*map), simplefs_dx_cmp, NULL);
+	simplefs_sort_groups(bh, map, n);
+	/* the part of the first group handed out already */
+	for (i = 0; i < n && map[i].hash == start && skip; i++, skip--)
+		rank++;
+	memmove(map, map + i, (n - i) * sizeof(*map));
+	n -= i;
+
+	if (plus) {
+		blk_start_plug(&plug);
+		for (i = 0; i < n; i++) {
+			rec = (struct simplefs_dir_record *)(bh->b_data + map[i].offs);
+			simplefs_inode_readahead(dir->i_sb, rec->inode_no);
+		}
+		blk_finish_plug(&plug);
+	}
+	if (plus == SIMPLEFS_DIRPLUS_ICACHE) {
+		for (i = 0; i < n; i++) {
+			rec = (struct simplefs_dir_record *)(bh->b_data + map[i].offs);
+			inode = simplefs_iget(dir->i_sb, rec->inode_no);
+			if (!IS_ERR(inode))
+				iput(inode);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		rec = (struct simplefs_dir_record *)(bh->b_data + map[i].offs);
+		if (i && map[i].hash == map[i - 1].hash)
+			rank++;
+		else if (i || map[i].hash != start)
+			rank = 0;
+		ctx->pos = simplefs_dir_pos(map[i].hash, rank, bits);
+		if (!dir_emit(ctx, rec->filename, rec->name_len, rec->inode_no,
+			      fs_ftype_to_dtype(rec->file_type)))
+			return false;
+	}
+	return true;
+}
+
+int simplefs_dir_iterate(struct file *file, struct dir_context *ctx, int plus)
+{
+	struct simplefs_dx_frame frames[SIMPLEFS_DX_MAX_LEVELS + 1];
+	struct inode *dir = file_inode(file);
+	struct simplefs_inode_info *sinfo = simplefs_i(dir);
+	unsigned int bits = simplefs_pos_bits(file);
+	struct simplefs_dx_map *map;
+	struct buffer_head *bh;
+	uint32_t block = 0, next;
+	int n = 0, err = 0;
+
+	if (ctx->pos >= simplefs_dir_pos(SIMPLEFS_HASH_EOF, 0, bits))
+		return 0;
+	if (!sinfo->dir_children_count) {
+		ctx->pos = simplefs_dir_pos(SIMPLEFS_HASH_EOF, 0, bits);
+		return 0;
+	}
+
+	map = kmalloc_array(SIMPLEFS_DIR_RECORDS_PER_BLOCK, sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return -ENOMEM;
+
+	if (sinfo->i_flags & SIMPLEFS_INDEX_FL) {
+		n = simplefs_dx_probe(dir, ctx->pos >> bits, frames);
+		if (n < 0) {
+			kfree(map);
+			return n;
+		}
+	}
+
+	for (;;) {
+		next = SIMPLEFS_HASH_EOF;
+		if (n) {
+			block = simplefs_dx_leaf(frames, n);
+			next = simplefs_dx_next_hash(frames, n);
+			simplefs_dx_readahead(dir, &frames[n - 1]);
+		}
+
+		bh = simplefs_leaf_bread(dir, block);
+		if (!bh) {
+			err = -EIO;
+			break;
+		}
+		if (!simplefs_leaf_emit(dir, bh, ctx, map, plus, bits)) {
+			brelse(bh);
+			break;
+		}
+		brelse(bh);
+
+		ctx->pos = simplefs_dir_pos(next, 0, bits);
+		if (next == SIMPLEFS_HASH_EOF)
+			break;
+		err = simplefs_dx_next(dir, frames, n);
+		if (err <= 0)
+			break;
+	}
+
+	if (n)
+		simplefs_dx_release(frames, n);
+	kfree(map);
+	return err < 0 ? err : 0;
+}
+
+/* Cookies run past s_maxbytes, up to the end cookie */
+loff_t simplefs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+	loff_t end = simplefs_dir_pos(SIMPLEFS_HASH_EOF, 0, simplefs_pos_bits(file));
+
+	return generic_file_llseek_size(file, offset, whence, end, end);
+}
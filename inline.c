@@ -0,0 +1,132 @@
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include "simple.h"
+
+/*
+ * Inline data.  A regular file of at most SIMPLEFS_INLINE_SIZE bytes keeps
+ * its contents in the on-disk inode, where the extent map would otherwise
+ * be, so reading it costs nothing past the inode table pinned at mount.
+ * Page 0 is filled from i_inline and every buffered write copies it back;
+ * the page itself never needs writeback.  Once the file grows past the
+ * limit, or is written through mmap, direct I/O or fallocate, page 0 is
+ * dirtied as a delayed allocation and the file stays extent mapped.
+ *
+ * The flag only ever goes from set to clear, with page 0 locked, so
+ * anything holding that page lock sees a stable answer.
+ */
+
+static void simplefs_inline_fill(struct inode *inode, struct page *page)
+{
+	loff_t size = min_t(loff_t, i_size_read(inode), SIMPLEFS_INLINE_SIZE);
+	void *kaddr;
+
+	kaddr = kmap_atomic(page);
+	if (!page->index)
+		memcpy(kaddr, simplefs_i(inode)->i_inline, size);
+	else
+		size = 0;
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	kunmap_atomic(kaddr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
+
+int simplefs_inline_readpage(struct inode *inode, struct page *page)
+{
+	simplefs_inline_fill(inode, page);
+	unlock_page(page);
+	return 0;
+}
+
+/* Buffered writes that keep a file inline come through generic_perform_write() */
+int simplefs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags, struct page **pagep,
+		void **fsdata)
+{
+	struct page *page;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page))
+		simplefs_inline_fill(mapping->host, page);
+	*pagep = page;
+	return 0;
+}
+
+int simplefs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied, struct page *page,
+		void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t size = max_t(loff_t, i_size_read(inode), pos + copied);
+	void *kaddr;
+
+	if (simplefs_has_inline(inode)) {
+		kaddr = kmap_atomic(page);
+		memcpy(simplefs_i(inode)->i_inline, kaddr,
+		       min_t(loff_t, size, SIMPLEFS_INLINE_SIZE));
+		kunmap_atomic(kaddr);
+	} else {
+		/* converted by a page fault since ->write_begin */
+		set_page_dirty(page);
+	}
+	if (size > i_size_read(inode))
+		i_size_write(inode, size);
+	unlock_page(page);
+	put_page(page);
+	mark_inode_dirty(inode);
+	return copied;
+}
+
+/*
+ * Move the data of an inline file to page 0 and make it extent mapped.
+ * The page is left dirty with a block reserved for it, so writeback
+ * allocates it like any other delayed write.
+ */
+int simplefs_inline_convert(struct inode *inode)
+{
+	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct page *page;
+	int err = 0;
+
+	page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+	if (!page)
+		return -ENOMEM;
+	down_write(&sinfo->i_extent_sem);
+	if (!(sinfo->i_flags & SIMPLEFS_INLINE_DATA_FL))
+		goto out;
+	if (i_size_read(inode)) {
+		err = simplefs_da_reserve(inode, 0, 1);
+		if (err)
+			goto out;
+		if (!PageUptodate(page))
+			simplefs_inline_fill(inode, page);
+		set_page_dirty(page);
+	}
+	sinfo->i_flags &= ~SIMPLEFS_INLINE_DATA_FL;
+	memset(sinfo->i_inline, 0, SIMPLEFS_INLINE_SIZE);
+out:
+	up_write(&sinfo->i_extent_sem);
+	unlock_page(page);
+	put_page(page);
+	if (!err)
+		mark_inode_dirty(inode);
+	return err;
+}
+
+/* Called with i_rwsem held before i_size changes to @size */
+int simplefs_inline_truncate(struct inode *inode, loff_t size)
+{
+	loff_t old = i_size_read(inode);
+
+	if (size > SIMPLEFS_INLINE_SIZE)
+		return simplefs_inline_convert(inode);
+	/* extending later must read zeros, not what was cut off */
+	if (size < old)
+		memset(simplefs_i(inode)->i_inline + size, 0,
+		       SIMPLEFS_INLINE_SIZE - size);
+	return 0;
+}
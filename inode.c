@@ -3,12 +3,39 @@
 #include <linux/fs.h>
 #include <linux/export.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/dax.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/ioprio.h>
 
 #include "simple.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Regular files on a -o dax mount bypass the page cache, except inline
+ * ones, which have no blocks to map
+ */
+void simplefs_set_aops(struct inode *inode)
+{
+	if (S_ISREG(inode->i_mode) && !simplefs_has_inline(inode) &&
+	    (simplefs_sb(inode->i_sb)->s_mount_opt & SIMPLEFS_MOUNT_DAX))
+		inode->i_flags |= S_DAX;
+	if (IS_DAX(inode))
+		inode->i_mapping->a_ops = &simplefs_dax_aops;
+	else
+		inode->i_mapping->a_ops = &simplefs_aops;
+}
+
 struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
 {
 	struct simplefs_inode *sinode;
@@ -22,44 +49,56 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
 	if (!(inode->i_state & I_NEW))
 		return inode;
 
-	if ((ino < SIMPLEFS_ROOTDIR_INODE_NUMBER) || (ino > SIMPLEFS_LAST_INODE_NUMBER)) {
-		printk(KERN_ERR "Bad inode number %s:%08lx\n", inode->i_sb->s_id, ino);
-		goto out;
-	}
-
-	bh = sb_bread(inode->i_sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	if (!bh) {
-		printk(KERN_ERR "Unable to read inode %s:%08lx\n", inode->i_sb->s_id, ino);
+	sinode = simplefs_raw_inode(sb, ino, &bh);
+	if (IS_ERR(sinode))
 		goto out;
-	}
-
-	sinode = (struct simplefs_inode *)bh->b_data + ino - SIMPLEFS_ROOTDIR_INODE_NUMBER;
 
 	inode->i_mode = sinode->mode;
 	sinfo = simplefs_i(inode);
-	sinfo->data_block_number = sinode->data_block_number;
+	sinfo->i_flags = sinode->i_flags;
+	if (simplefs_ext_load(inode, sinode)) {
+		printk(KERN_ERR "Bad extent map in inode %s:%08lx\n", inode->i_sb->s_id, ino);
+		goto out;
+	}
+	if (sinfo->i_flags & SIMPLEFS_INLINE_DATA_FL) {
+		/* a symlink target keeps its NUL inside i_data */
+		if ((!S_ISREG(inode->i_mode) && !S_ISLNK(inode->i_mode)) ||
+		    sinode->i_extent_count || sinode->file_size > SIMPLEFS_INLINE_SIZE -
+		    S_ISLNK(inode->i_mode)) {
+			printk(KERN_ERR "Bad inline data in inode %s:%08lx\n",
+					inode->i_sb->s_id, ino);
+			goto out;
+		}
+		memcpy(sinfo->i_inline, sinode->i_data, SIMPLEFS_INLINE_SIZE);
+	}
 	if (S_ISDIR(inode->i_mode)) {
-		sinfo->dir_children_count = inode->i_blocks = sinode->dir_children_count;
-		inode->i_size = sinfo->dir_children_count * sizeof(struct simplefs_dir_record);
+		sinfo->dir_children_count = sinode->dir_children_count;
+		inode->i_size = simplefs_ext_end(inode) << inode->i_blkbits;
 		inode->i_op = &simplefs_dir_inops;
 		inode->i_fop = &simplefs_dir_operations;
 	} else if (S_ISREG(inode->i_mode)) {
-		sinfo->file_size = inode->i_size = sinode->file_size;
+		inode->i_size = sinode->file_size;
 		inode->i_op = &simplefs_file_inops;
 		inode->i_fop = &simplefs_file_operations;
 	} else if (S_ISLNK(inode->i_mode)) {
+		inode->i_size = sinode->file_size;
 		inode->i_op = &simplefs_symlink_inops;
-		inode_nohighmem(inode);
+		if (sinfo->i_flags & SIMPLEFS_INLINE_DATA_FL) {
+			sinfo->i_inline[inode->i_size] = '\0';
+			inode->i_link = sinfo->i_inline;
+			inode->i_op = &simplefs_fast_symlink_inops;
+		}
 	}
-	if (IS_DAX(inode))
-		inode->i_mapping->a_ops = &simplefs_dax_aops;
-	else
-		inode->i_mapping->a_ops = &simplefs_aops;
+	simplefs_set_aops(inode);
 
 	set_nlink(inode, sinode->i_nlink);
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+	inode->i_atime.tv_sec = sinode->i_atime;
+	inode->i_atime.tv_nsec = sinode->i_atime_nsec;
+	inode->i_mtime.tv_sec = sinode->i_mtime;
+	inode->i_mtime.tv_nsec = sinode->i_mtime_nsec;
+	inode->i_ctime.tv_sec = sinode->i_ctime;
+	inode->i_ctime.tv_nsec = sinode->i_ctime_nsec;
 
-	brelse(bh);
 	unlock_new_inode(inode);
 	return inode;
 
@@ -68,80 +107,403 @@ out:
 	return ERR_PTR(-EIO);
 }
 
-static struct simplefs_inode *find_inode(struct super_block *sb, unsigned long ino, struct buffer_head **p)
+/*
+ * Return the on-disk inode @ino inside the pinned inode table.  *p is set to
+ * the buffer holding it; the table keeps its own reference, so callers
+ * dirty the buffer but never release it.
+ */
+struct simplefs_inode *simplefs_raw_inode(struct super_block *sb, unsigned long ino,
+		struct buffer_head **p)
 {
-	if ((ino < SIMPLEFS_ROOTDIR_INODE_NUMBER) || (ino > SIMPLEFS_LAST_INODE_NUMBER)) {
-		printk("Bad inode number %s:%lu\n", sb->s_id, ino);
+	struct simplefs_sb_info *sbinfo = simplefs_sb(sb);
+	unsigned long index;
+
+	if ((ino < SIMPLEFS_ROOTDIR_INODE_NUMBER) || (ino > sbinfo->sb->max_inodes)) {
+		printk(KERN_ERR "Bad inode number %s:%lu\n", sb->s_id, ino);
 		return ERR_PTR(-EIO);
 	}
 
-	*p = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	if (!*p) {
-		printk("Unable to read inode %s:%lu\n", sb->s_id, ino);
-		return ERR_PTR(-EIO);
+	index = ino - SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	*p = sbinfo->itable[index / SIMPLEFS_INODES_PER_BLOCK];
+	return (struct simplefs_inode *)(*p)->b_data + index % SIMPLEFS_INODES_PER_BLOCK;
+}
+
+/*
+ * Start reading what simplefs_iget() needs for @ino and has to go to disk
+ * for.  The inode table itself is pinned, so that is the extent block of
+ * an inode whose map spilled out of it.  Callers plug around a batch.
+ */
+void simplefs_inode_readahead(struct super_block *sb, unsigned long ino)
+{
+	struct simplefs_inode *sinode;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint64_t blk;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		iput(inode);
+		return;
 	}
+	sinode = simplefs_raw_inode(sb, ino, &bh);
+	if (IS_ERR(sinode))
+		return;
+	blk = READ_ONCE(sinode->i_extent_block);
+	if (blk)
+		sb_breadahead(sb, blk);
+}
+
+/*
+ * Pin the whole inode table.  Every block is read ahead in one plugged
+ * batch before the first sb_bread() waits, so mounting costs one pass
+ * over the table at the device's pace instead of a round trip per block.
+ * A table that would pin more than a quarter of memory is refused.
+ */
+static int simplefs_load_itable(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	struct blk_plug plug;
+	uint64_t i;
+
+	if (sb->inodestore_blocks > totalram_pages() / 4) {
+		printk(KERN_ERR "simplefs: %s: inode table of %llu blocks does not fit in memory\n",
+				s->s_id, (unsigned long long)sb->inodestore_blocks);
+		return -ENOMEM;
+	}
+	sbinfo->itable = kvcalloc(sb->inodestore_blocks, sizeof(struct buffer_head *),
+			GFP_KERNEL);
+	if (!sbinfo->itable)
+		return -ENOMEM;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < sb->inodestore_blocks; i++)
+		sb_breadahead(s, sb->inodestore_block + i);
+	blk_finish_plug(&plug);
 
-	return (struct simplefs_inode *)(*p)->b_data +  ino - SIMPLEFS_ROOTDIR_INODE_NUMBER;
+	for (i = 0; i < sb->inodestore_blocks; i++) {
+		sbinfo->itable[i] = sb_bread(s, sb->inodestore_block + i);
+		if (!sbinfo->itable[i])
+			return -EIO;
+	}
+	return 0;
 }
 
-static int simplefs_write_inode(struct inode *inode, struct writeback_control *wbc)
+static void simplefs_put_itable(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	uint64_t i;
+
+	if (sbinfo->itable) {
+		for (i = 0; i < sbinfo->sb->inodestore_blocks; i++)
+			brelse(sbinfo->itable[i]);
+	}
+	kvfree(sbinfo->itable);
+	sbinfo->itable = NULL;
+}
+
+/*
+ * Write out the dirty inode table blocks, each once however many of its
+ * inodes changed, and wait for them if @wait
+ */
+static int simplefs_sync_itable(struct super_block *s, int wait)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	uint64_t i, n = sbinfo->sb->inodestore_blocks;
+	struct blk_plug plug;
+	int err = 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		if (buffer_dirty(sbinfo->itable[i]))
+			write_dirty_buffer(sbinfo->itable[i], wait ? REQ_SYNC : 0);
+	}
+	blk_finish_plug(&plug);
+	if (!wait)
+		return 0;
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(sbinfo->itable[i]);
+		if (buffer_req(sbinfo->itable[i]) &&
+		    !buffer_uptodate(sbinfo->itable[i]))
+			err = -EIO;
+	}
+	return err;
+}
+
+/*
+ * mkfs leaves the inode table of a block device as it found it, from
+ * sb->itable_uninit on, and this thread zeroes it after mount: the free
+ * slots of SIMPLEFS_LAZYINIT_BATCH blocks at a time, at idle I/O priority,
+ * sleeping SIMPLEFS_LAZYINIT_RATIO times as long as each batch took.  The
+ * mark only moves past a batch once the batch is on disk, so a crash
+ * leaves it behind what was zeroed, never ahead of it.
+ */
+#define SIMPLEFS_LAZYINIT_BATCH	16
+#define SIMPLEFS_LAZYINIT_RATIO	10
+
+static int simplefs_lazyinit_batch(struct super_block *s, uint64_t start,
+		uint64_t end)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	handle_t *handle;
+	uint64_t i;
+	int err = 0;
+
+	handle = simplefs_journal_start(s, end - start + 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	for (i = start; i < end && !err; i++) {
+		bh = sbinfo->itable[i];
+		err = simplefs_get_write_access(bh);
+		if (err)
+			break;
+		simplefs_zero_free_inodes(s, bh,
+				i * SIMPLEFS_INODES_PER_BLOCK + SIMPLEFS_ROOTDIR_INODE_NUMBER);
+		simplefs_dirty_metadata(bh, NULL);
+	}
+	if (!handle && !err) {
+		blk_start_plug(&plug);
+		for (i = start; i < end; i++)
+			write_dirty_buffer(sbinfo->itable[i], REQ_SYNC);
+		blk_finish_plug(&plug);
+		for (i = start; i < end; i++) {
+			wait_on_buffer(sbinfo->itable[i]);
+			if (buffer_req(sbinfo->itable[i]) &&
+			    !buffer_uptodate(sbinfo->itable[i]))
+				err = -EIO;
+		}
+	}
+	if (!err)
+		err = simplefs_get_write_access(sbinfo->sbh);
+	if (!err) {
+		lock_buffer(sbinfo->sbh);
+		sb->itable_uninit = end < sb->inodestore_blocks ? end : 0;
+		unlock_buffer(sbinfo->sbh);
+		simplefs_dirty_metadata(sbinfo->sbh, NULL);
+		/* under a journal, commits the batch along with the mark */
+		simplefs_sync_metadata(sbinfo->sbh);
+	}
+	simplefs_journal_stop(handle);
+	return err;
+}
+
+static int simplefs_lazyinit_thread(void *data)
+{
+	struct super_block *s = data;
+	struct simplefs_super_block *sb = simplefs_sb(s)->sb;
+	uint64_t start, end;
+	unsigned long t;
+	int err;
+
+	set_user_nice(current, MAX_NICE);
+	set_task_ioprio(current, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+	while (!kthread_should_stop()) {
+		start = READ_ONCE(sb->itable_uninit);
+		if (!start)
+			break;
+		end = min_t(uint64_t, start + SIMPLEFS_LAZYINIT_BATCH,
+				sb->inodestore_blocks);
+		t = jiffies;
+		err = simplefs_lazyinit_batch(s, start, end);
+		if (err) {
+			printk(KERN_ERR "simplefs: %s: zeroing the inode table failed: %d\n",
+					s->s_id, err);
+			break;
+		}
+		schedule_timeout_interruptible((jiffies - t) *
+				SIMPLEFS_LAZYINIT_RATIO + 1);
+	}
+	/* put_super or remount stops the thread, which must still be there for it */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/* Start zeroing the rest of the inode table, unless done or under way */
+static void simplefs_lazyinit_start(struct super_block *s)
+{
+	struct simplefs_sb_info *sbi = simplefs_sb(s);
+
+	if (!sbi->sb->itable_uninit || sbi->s_lazyinit)
+		return;
+	sbi->s_lazyinit = kthread_run(simplefs_lazyinit_thread, s,
+			"simplefs-itable/%s", s->s_id);
+	if (IS_ERR(sbi->s_lazyinit)) {
+		printk("simplefs: %s: inode table left for a later mount to zero.\n",
+				s->s_id);
+		sbi->s_lazyinit = NULL;
+	}
+}
+
+/* Returns once the batch in flight, if any, is committed */
+static void simplefs_lazyinit_stop(struct super_block *s)
+{
+	struct simplefs_sb_info *sbi = simplefs_sb(s);
+
+	if (sbi->s_lazyinit)
+		kthread_stop(sbi->s_lazyinit);
+	sbi->s_lazyinit = NULL;
+}
+
+/* Copy @inode into its slot of the inode table, writing it out if @sync */
+static int simplefs_store_inode(struct inode *inode, int sync)
 {
-	struct simplefs_sb_info *sbinfo = simplefs_sb(inode->i_sb);
 	unsigned long ino = inode->i_ino;
 	struct simplefs_inode *sinode;
 	struct simplefs_inode_info *sinfo = simplefs_i(inode);
+	struct simplefs_inode raw;
 	struct buffer_head *bh;
 	int err = 0;
 
-	sinode = find_inode(inode->i_sb, ino, &bh);
+	sinode = simplefs_raw_inode(inode->i_sb, ino, &bh);
 	if (IS_ERR(sinode))
 		return PTR_ERR(sinode);
-
-	mutex_lock(&sbinfo->simplefs_lock);
-
-	sinode->inode_no = ino;
-	sinode->mode = inode->i_mode;
-	sinode->i_nlink = inode->i_nlink;
-	sinode->data_block_number = sinfo->data_block_number;
+	err = simplefs_get_write_access(bh);
+	if (err)
+		return err;
+
+	/* build the new copy aside, the table block is shared with other inodes */
+	memset(&raw, 0, sizeof(raw));
+	raw.inode_no = ino;
+	raw.mode = inode->i_mode;
+	raw.i_flags = sinfo->i_flags;
+	raw.i_nlink = inode->i_nlink;
+	raw.i_atime = inode->i_atime.tv_sec;
+	raw.i_atime_nsec = inode->i_atime.tv_nsec;
+	raw.i_mtime = inode->i_mtime.tv_sec;
+	raw.i_mtime_nsec = inode->i_mtime.tv_nsec;
+	raw.i_ctime = inode->i_ctime.tv_sec;
+	raw.i_ctime_nsec = inode->i_ctime.tv_nsec;
+	err = simplefs_ext_store(inode, &raw, sync);
+	if (raw.i_flags & SIMPLEFS_INLINE_DATA_FL)
+		memcpy(raw.i_data, sinfo->i_inline, SIMPLEFS_INLINE_SIZE);
 
 	if (S_ISDIR(inode->i_mode)) {
-		sinode->dir_children_count = sinfo->dir_children_count;
+		raw.dir_children_count = sinfo->dir_children_count;
 	} else {
-		sinode->file_size = sinfo->file_size;
+		raw.file_size = i_size_read(inode);
 	}
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-	mutex_unlock(&sbinfo->simplefs_lock);
+	spin_lock(&sinfo->i_raw_lock);
+	*sinode = raw;
+	spin_unlock(&sinfo->i_raw_lock);
+
+	/* the flusher writes the table block back with its neighbours */
+	simplefs_dirty_metadata(bh, NULL);
+	if (sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			err = -EIO;
+	}
 	return err;
 }
 
-static void simplefs_evict_inode(struct inode *inode)
+/*
+ * Under a journal every change to an inode is logged as it happens, in the
+ * transaction of the operation that made it.  Without one the inode is
+ * only copied out at writeback time.  Timestamp-only updates under
+ * lazytime stay in memory until the VFS turns them into a real dirtying
+ * on sync, fsync or expiry.
+ */
+static void simplefs_dirty_inode(struct inode *inode, int flags)
+{
+	handle_t *handle;
+
+	if (!simplefs_sb(inode->i_sb)->journal || flags == I_DIRTY_TIME)
+		return;
+	handle = simplefs_journal_start(inode->i_sb, SIMPLEFS_INODE_CREDITS);
+	if (IS_ERR(handle)) {
+		printk(KERN_ERR "simplefs: %s: cannot log inode %lu\n",
+				inode->i_sb->s_id, inode->i_ino);
+		return;
+	}
+	simplefs_store_inode(inode, 0);
+	simplefs_i(inode)->i_sync_tid = handle->h_transaction->t_tid;
+	simplefs_journal_stop(handle);
+}
+
+/*
+ * Without a journal the inode is copied into the pinned table buffer and
+ * that is only marked dirty.  fsync still writes it out at once, but sync()
+ * leaves it to ->sync_fs, which writes each table block a single time.
+ */
+static int simplefs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	journal_t *journal = simplefs_sb(inode->i_sb)->journal;
+	int sync = wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync;
+	int ret = 0;
+
+	if (!journal)
+		ret = simplefs_store_inode(inode, sync);
+	/* already logged; sync() commits the lot from ->sync_fs */
+	else if (sync)
+		ret = jbd2_complete_transaction(journal, simplefs_i(inode)->i_sync_tid);
+	trace_simplefs_write_inode(inode, sync, ret);
+	return ret;
+}
+
+/* Give back the blocks, the table slot and the number of a deleted inode */
+static int simplefs_free_inode(struct inode *inode)
 {
 	struct simplefs_inode *sinode;
 	struct buffer_head *bh;
 	struct super_block *s = inode->i_sb;
-	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
-
-	truncate_inode_pages_final(&inode->i_data);
-	invalidate_inode_buffers(inode);
-	clear_inode(inode);
+	int err;
 
-	if (inode->i_nlink)
-		return;
+	err = simplefs_ext_free(inode);
+	if (err)
+		return err;
 
-	sinode = find_inode(s, inode->i_ino, &bh);
+	sinode = simplefs_raw_inode(s, inode->i_ino, &bh);
 	if (IS_ERR(sinode))
-		return;
-
-	mutex_lock(&sbinfo->simplefs_lock);
+		return PTR_ERR(sinode);
+	err = simplefs_journal_ensure_credits(SIMPLEFS_FREE_CREDITS);
+	if (!err)
+		err = simplefs_get_write_access(bh);
+	if (err)
+		return err;
 
+	spin_lock(&simplefs_i(inode)->i_raw_lock);
 	memset(sinode, 0, sizeof(struct simplefs_inode));
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
-	mutex_unlock(&sbinfo->simplefs_lock);
+	spin_unlock(&simplefs_i(inode)->i_raw_lock);
+	simplefs_dirty_metadata(bh, NULL);
+	return simplefs_free_inode_no(s, inode->i_ino, inode->i_mode);
+}
+
+static void simplefs_evict_inode(struct inode *inode)
+{
+	struct super_block *s = inode->i_sb;
+	handle_t *handle;
+	int err;
+
+	trace_simplefs_evict_inode(inode);
+	truncate_inode_pages_final(&inode->i_data);
+	simplefs_da_drop(inode);
+	if (!inode->i_nlink) {
+		handle = simplefs_journal_start(s, SIMPLEFS_EVICT_CREDITS);
+		if (IS_ERR(handle)) {
+			printk(KERN_ERR "simplefs: %s: cannot free inode %lu\n",
+					s->s_id, inode->i_ino);
+		} else {
+			/* half freed: stop the journal rather than commit it */
+			err = simplefs_free_inode(inode);
+			if (err) {
+				printk(KERN_ERR "simplefs: %s: cannot free inode %lu: %d\n",
+						s->s_id, inode->i_ino, err);
+				simplefs_journal_abort(s, err);
+			}
+			simplefs_journal_stop(handle);
+		}
+	}
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
 }
 
 static void simplefs_put_super(struct super_block *sb)
@@ -150,24 +512,86 @@ static void simplefs_put_super(struct super_block *sb)
 
 	if (!sbinfo)
 		return;
-	mutex_destroy(&sbinfo->simplefs_lock);
+	simplefs_lazyinit_stop(sb);
+	destroy_workqueue(sbinfo->s_unwritten_wq);
+	simplefs_sync_counts(sb);
+	simplefs_journal_destroy(sb);
+	simplefs_put_itable(sb);
+	simplefs_put_bitmaps(sb);
+	fs_put_dax(sbinfo->s_daxdev);
+	sync_dirty_buffer(sbinfo->sbh);
 	brelse(sbinfo->sbh);
 	sb->s_fs_info = NULL;
 	kfree(sbinfo);
 }
 
+/*
+ * The free counts are per-CPU and only copied into the pinned super block
+ * buffer here.  The inode table blocks collected every inode written back
+ * by sync() and are written here, once each; the bitmaps are block device
+ * buffers and go out with the sync_blockdev() that follows.  Under a
+ * journal all of them are logged: commit the running transaction instead.
+ */
+static int simplefs_sync_fs(struct super_block *sb, int wait)
+{
+	struct buffer_head *sbh = simplefs_sb(sb)->sbh;
+	journal_t *journal = simplefs_sb(sb)->journal;
+	tid_t target;
+	int err;
+
+	simplefs_sync_counts(sb);
+	if (journal) {
+		if (jbd2_journal_start_commit(journal, &target) && wait)
+			return jbd2_log_wait_commit(journal, target);
+		return 0;
+	}
+	err = simplefs_sync_itable(sb, wait);
+	if (!wait) {
+		write_dirty_buffer(sbh, 0);
+		return 0;
+	}
+	sync_dirty_buffer(sbh);
+	if (buffer_req(sbh) && !buffer_uptodate(sbh))
+		return -EIO;
+	return err;
+}
+
 static int simplefs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *s = dentry->d_sb;
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
 	u64 id = huge_encode_dev(s->s_bdev->bd_dev);
 	buf->f_type = SIMPLEFS_MAGIC;
 	buf->f_bsize = s->s_blocksize;
+	buf->f_blocks = sb->blocks_count - sb->data_block;
+	buf->f_bfree = max_t(s64, 0,
+			percpu_counter_sum_positive(&sbinfo->s_free_blocks) -
+			percpu_counter_sum_positive(&sbinfo->s_reserved_blocks));
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sb->max_inodes;
+	buf->f_ffree = percpu_counter_sum_positive(&sbinfo->s_free_inodes);
 	buf->f_fsid.val[0] = (u32)id;
 	buf->f_fsid.val[1] = (u32)(id >> 32);
 	buf->f_namelen = SIMPLEFS_FILENAME_MAXLEN;
 	return 0;
 }
 
+static int simplefs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(root->d_sb);
+
+	if (sbinfo->s_mount_opt & SIMPLEFS_MOUNT_JOURNAL)
+		seq_puts(seq, ",journal");
+	if (sbinfo->s_mount_opt & SIMPLEFS_MOUNT_DAX)
+		seq_puts(seq, ",dax");
+	if (sbinfo->s_mount_opt & SIMPLEFS_MOUNT_DIRPLUS)
+		seq_puts(seq, ",dirplus");
+	if (sbinfo->s_commit_interval)
+		seq_printf(seq, ",commit=%u", sbinfo->s_commit_interval);
+	return 0;
+}
+
 static struct kmem_cache *simplefs_inode_cachep;
 
 static struct inode *simplefs_alloc_inode(struct super_block *sb)
@@ -176,12 +600,18 @@ static struct inode *simplefs_alloc_inode(struct super_block *sb)
 	sinfo = kmem_cache_alloc(simplefs_inode_cachep, GFP_KERNEL);
 	if (!sinfo)
 		return NULL;
+	sinfo->i_extent = sinfo->i_extent_inline;
+	sinfo->i_extent_count = 0;
+	sinfo->i_extent_block = 0;
+	sinfo->i_flags = 0;
+	sinfo->i_readdir_time = 0;
 	return &sinfo->vfs_inode;
 }
 
 static void simplefs_i_callback(struct rcu_head *head)
 {
 	struct inode *inode = container_of(head, struct inode, i_rcu);
+	simplefs_ext_release(simplefs_i(inode));
 	kmem_cache_free(simplefs_inode_cachep, simplefs_i(inode));
 }
 
@@ -193,18 +623,87 @@ static void simplefs_destroy_inode(struct inode *inode)
 static void init_once(void *foo)
 {
 	struct simplefs_inode_info *sinfo = (struct simplefs_inode_info *)foo;
+	init_rwsem(&sinfo->i_extent_sem);
+	init_rwsem(&sinfo->i_dax_sem);
+	xa_init(&sinfo->i_delalloc);
+	spin_lock_init(&sinfo->i_raw_lock);
 	inode_init_once(&sinfo->vfs_inode);
 }
 
+/*
+ * The lazy init thread only runs read-write.  It is stopped before the
+ * sync of a remount,ro so that no batch lands after it, and started again
+ * by remount,rw if the table is not done.
+ */
+static int simplefs_remount(struct super_block *s, int *flags, char *data)
+{
+	if (*flags & SB_RDONLY)
+		simplefs_lazyinit_stop(s);
+	sync_filesystem(s);
+	if (!(*flags & SB_RDONLY) && sb_rdonly(s))
+		simplefs_lazyinit_start(s);
+	return 0;
+}
+
 static struct super_operations simplefs_sops = {
 	.alloc_inode	= simplefs_alloc_inode,
 	.destroy_inode	= simplefs_destroy_inode,
+	.dirty_inode	= simplefs_dirty_inode,
 	.write_inode	= simplefs_write_inode,
 	.evict_inode	= simplefs_evict_inode,
 	.put_super	= simplefs_put_super,
+	.sync_fs	= simplefs_sync_fs,
 	.statfs		= simplefs_statfs,
+	.remount_fs	= simplefs_remount,
+	.show_options	= simplefs_show_options,
 };
 
+enum {
+	Opt_journal, Opt_commit, Opt_dax, Opt_dirplus, Opt_err
+};
+
+static const match_table_t simplefs_tokens = {
+	{Opt_journal, "journal"},
+	{Opt_commit, "commit=%u"},
+	{Opt_dax, "dax"},
+	{Opt_dirplus, "dirplus"},
+	{Opt_err, NULL},
+};
+
+static int simplefs_parse_options(char *options, struct simplefs_sb_info *sbi)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int n;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, simplefs_tokens, args)) {
+		case Opt_journal:
+			sbi->s_mount_opt |= SIMPLEFS_MOUNT_JOURNAL;
+			break;
+		case Opt_commit:
+			if (match_int(&args[0], &n) || n < 0)
+				return -EINVAL;
+			sbi->s_commit_interval = n;
+			break;
+		case Opt_dax:
+			sbi->s_mount_opt |= SIMPLEFS_MOUNT_DAX;
+			break;
+		case Opt_dirplus:
+			sbi->s_mount_opt |= SIMPLEFS_MOUNT_DIRPLUS;
+			break;
+		default:
+			printk(KERN_ERR "simplefs: unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 
 static int simplefs_fill_super(struct super_block *s, void *data, int silent)
 {
@@ -217,10 +716,25 @@ static int simplefs_fill_super(struct super_block *s, void *data, int silent)
 	sbi = kzalloc(sizeof(struct simplefs_sb_info), GFP_KERNEL);
 	if (!sbi)
 		return -ENOMEM;
-	mutex_init(&sbi->simplefs_lock);
 	s->s_fs_info = sbi;
+	if (simplefs_parse_options(data, sbi))
+		goto out;
 
+	/* file writeback maps one block per page */
+	if (PAGE_SIZE != SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+		printk("simplefs: page size must be %d.\n", SIMPLEFS_DEFAULT_BLOCK_SIZE);
+		goto out;
+	}
 	sb_set_blocksize(s, SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	if (sbi->s_mount_opt & SIMPLEFS_MOUNT_DAX) {
+		sbi->s_daxdev = fs_dax_get_by_bdev(s->s_bdev);
+		if (!bdev_dax_supported(s->s_bdev, SIMPLEFS_DEFAULT_BLOCK_SIZE)) {
+			printk("simplefs: DAX unsupported by block device. Turning off DAX.\n");
+			sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_DAX;
+		}
+	}
+	/* extents address blocks with 32 bits */
+	s->s_maxbytes = (loff_t)U32_MAX << s->s_blocksize_bits;
 
 	sbh = sb_bread(s, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
 	if (!sbh)
@@ -234,29 +748,78 @@ static int simplefs_fill_super(struct super_block *s, void *data, int silent)
 		printk("simplefs: magicnumber mismatch.\n");
 		goto out1;
 	}
+	if (sb->version != SIMPLEFS_VERSION) {
+		printk("simplefs: layout version %llu, expected %d; rerun mkfs-simplefs.\n",
+				(unsigned long long)sb->version, SIMPLEFS_VERSION);
+		goto out1;
+	}
+	if (sb->block_size != SIMPLEFS_DEFAULT_BLOCK_SIZE ||
+	    !sb->inodestore_blocks ||
+	    sb->max_inodes > sb->inodestore_blocks * SIMPLEFS_INODES_PER_BLOCK ||
+	    sb->data_block < sb->inodestore_block + sb->inodestore_blocks ||
+	    sb->data_block >= sb->blocks_count ||
+	    (sb->journal_blocks &&
+	     (sb->journal_block < sb->inodestore_block + sb->inodestore_blocks ||
+	      sb->data_block < sb->journal_block + sb->journal_blocks)) ||
+	    sb->itable_uninit >= sb->inodestore_blocks) {
+		printk("simplefs: bad geometry.\n");
+		goto out1;
+	}
 	s->s_magic = sb->magic;
+	s->s_time_gran = 1;
+	/* atime and mtime updates alone never write the inode table right away */
+	s->s_flags |= SB_LAZYTIME;
+
+	ret = -ENOMEM;
+	sbi->s_unwritten_wq = alloc_workqueue("simplefs-unwritten/%s",
+			WQ_MEM_RECLAIM, 0, s->s_id);
+	if (!sbi->s_unwritten_wq)
+		goto out1;
+
+	/* replay before anything else reads the metadata */
+	ret = simplefs_journal_load(s);
+	if (ret)
+		goto out1;
+
+	ret = simplefs_load_itable(s);
+	if (ret) {
+		printk("simplefs: unable to read inode table.\n");
+		goto out2;
+	}
+	ret = simplefs_load_bitmaps(s);
+	if (ret) {
+		printk("simplefs: unable to read bitmaps.\n");
+		goto out2;
+	}
+	ret = -EINVAL;
 
 	s->s_op = &simplefs_sops;
 	root_inode = simplefs_iget(s, SIMPLEFS_ROOTDIR_INODE_NUMBER);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto out1;
+		goto out2;
 	}
 
 	s->s_root = d_make_root(root_inode);
 	if (!s->s_root) {
 		ret = -ENOMEM;
-		goto out1;
+		goto out2;
 	}
 
-	mark_buffer_dirty(sbh);
-	sync_dirty_buffer(sbh);
+	if (!sb_rdonly(s))
+		simplefs_lazyinit_start(s);
 	return 0;
 
+out2:
+	simplefs_journal_destroy(s);
+	simplefs_put_itable(s);
+	simplefs_put_bitmaps(s);
 out1:
+	if (sbi->s_unwritten_wq)
+		destroy_workqueue(sbi->s_unwritten_wq);
 	brelse(sbh);
 out:
-	mutex_destroy(&sbi->simplefs_lock);
+	fs_put_dax(sbi->s_daxdev);
 	s->s_fs_info = NULL;
 	kfree(sbi);
 	return ret;
@@ -0,0 +1,189 @@
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/jbd2.h>
+#include "simple.h"
+
+/*
+ * Optional metadata journal.  mkfs-simplefs -j reserves a jbd2 log after
+ * the inode table and "-o journal" runs every namespace operation and every
+ * block or inode allocation inside a jbd2 handle.  Handles started while a
+ * transaction is open join it, so a burst of creates or unlinks reaches the
+ * log in a single commit once the commit interval ("-o commit=<seconds>")
+ * expires or somebody syncs.  File data is not journaled.
+ *
+ * Without a journal the helpers below fall back to dirtying the buffers
+ * for the flusher, exactly as before.
+ */
+
+int simplefs_journal_load(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+	struct simplefs_super_block *sb = sbinfo->sb;
+	journal_t *journal;
+	int err;
+
+	if (!sb->journal_blocks) {
+		if (!(sbinfo->s_mount_opt & SIMPLEFS_MOUNT_JOURNAL))
+			return 0;
+		printk(KERN_ERR "simplefs: %s has no journal, see mkfs-simplefs -j\n", s->s_id);
+		return -EINVAL;
+	}
+
+	journal = jbd2_journal_init_dev(s->s_bdev, s->s_bdev, sb->journal_block,
+			sb->journal_blocks, s->s_blocksize);
+	if (!journal) {
+		printk(KERN_ERR "simplefs: %s: cannot set up the journal\n", s->s_id);
+		return -EINVAL;
+	}
+	journal->j_private = s;
+
+	/* replays whatever a crash left in the log, with or without -o journal */
+	err = jbd2_journal_load(journal);
+	if (err) {
+		printk(KERN_ERR "simplefs: %s: cannot load the journal\n", s->s_id);
+		jbd2_journal_destroy(journal);
+		return err;
+	}
+
+	if (!(sbinfo->s_mount_opt & SIMPLEFS_MOUNT_JOURNAL)) {
+		jbd2_journal_destroy(journal);
+		return 0;
+	}
+
+	if (sbinfo->s_commit_interval)
+		journal->j_commit_interval = sbinfo->s_commit_interval * HZ;
+	journal->j_flags |= JBD2_BARRIER;
+	sbinfo->journal = journal;
+	return 0;
+}
+
+/* Commit and checkpoint everything, leaving an empty log behind */
+void simplefs_journal_destroy(struct super_block *s)
+{
+	struct simplefs_sb_info *sbinfo = simplefs_sb(s);
+
+	if (!sbinfo->journal)
+		return;
+	if (jbd2_journal_destroy(sbinfo->journal) < 0)
+		printk(KERN_ERR "simplefs: %s: journal aborted\n", s->s_id);
+	sbinfo->journal = NULL;
+}
+
+/* Stop logging after an update that could only be half done */
+void simplefs_journal_abort(struct super_block *sb, int err)
+{
+	journal_t *journal = simplefs_sb(sb)->journal;
+
+	if (journal)
+		jbd2_journal_abort(journal, err);
+}
+
+/* Returns NULL when there is no journal, callers only check IS_ERR() */
+handle_t *simplefs_journal_start(struct super_block *sb, int credits)
+{
+	journal_t *journal = simplefs_sb(sb)->journal;
+
+	if (!journal)
+		return NULL;
+	return jbd2_journal_start(journal, credits);
+}
+
+int simplefs_journal_stop(handle_t *handle)
+{
+	if (!handle)
+		return 0;
+	return jbd2_journal_stop(handle);
+}
+
+/*
+ * Make sure the running handle may still dirty @credits buffers, closing
+ * the transaction and joining the next one if it cannot grow.  Only the
+ * outermost handle may be restarted.
+ */
+int simplefs_journal_ensure_credits(int credits)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle || handle->h_buffer_credits >= credits)
+		return 0;
+	if (!jbd2_journal_extend(handle, credits))
+		return 0;
+	return jbd2_journal_restart(handle, credits);
+}
+
+/* Call before changing a metadata buffer */
+int simplefs_get_write_access(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_write_access(handle, bh);
+}
+
+/* Same for a freshly allocated block, with the buffer locked */
+int simplefs_get_create_access(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (!handle)
+		return 0;
+	return jbd2_journal_get_create_access(handle, bh);
+}
+
+/*
+ * Hand a changed metadata buffer to the running transaction, or mark it
+ * dirty.  Without a journal a buffer dirtied on behalf of @inode goes out
+ * with the inode's fsync.
+ */
+void simplefs_dirty_metadata(struct buffer_head *bh, struct inode *inode)
+{
+	handle_t *handle = journal_current_handle();
+	int err;
+
+	if (!handle) {
+		if (inode)
+			mark_buffer_dirty_inode(bh, inode);
+		else
+			mark_buffer_dirty(bh);
+		return;
+	}
+	err = jbd2_journal_dirty_metadata(handle, bh);
+	if (err)
+		printk(KERN_ERR "simplefs: journaling block %llu failed: %d\n",
+				(unsigned long long)bh->b_blocknr, err);
+}
+
+/* Write the buffer now; under a journal, commit the transaction instead */
+void simplefs_sync_metadata(struct buffer_head *bh)
+{
+	handle_t *handle = journal_current_handle();
+
+	if (handle) {
+		handle->h_sync = 1;
+		return;
+	}
+	sync_dirty_buffer(bh);
+}
+
+/*
+ * Drop a freed metadata block from the buffer cache so that a stale dirty
+ * copy never lands on its next owner.  Under a journal the block is also
+ * revoked, keeping replay from writing old contents back.
+ */
+void simplefs_forget_block(struct super_block *sb, sector_t blk)
+{
+	handle_t *handle = journal_current_handle();
+	struct buffer_head *bh = sb_find_get_block(sb, blk);
+
+	if (!handle) {
+		bforget(bh);
+		return;
+	}
+	/* the revoke consumes our reference unless it fails */
+	if (jbd2_journal_revoke(handle, blk, bh)) {
+		printk(KERN_ERR "simplefs: %s: cannot revoke block %llu\n",
+				sb->s_id, (unsigned long long)blk);
+		brelse(bh);
+	}
+}
@@ -1,153 +1,985 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <errno.h>
+#include <search.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #include "simple_fs.h"
 
-const uint64_t WELCOMEFILE_DATABLOCK_NUMBER = 3;
 const uint64_t WELCOMEFILE_INODE_NUMBER = 2;
 
-static int write_superblock(int fd)
+/* Images smaller than this are grown to it, as before */
+#define SIMPLEFS_DEFAULT_IMAGE_SIZE (4096 * 1024)
+
+/* Zeros written at a time where the device cannot zero a range itself */
+#define SIMPLEFS_ZERO_CHUNK (1024 * 1024)
+
+/* One inode per this many bytes of image unless -N/-i say otherwise */
+#define SIMPLEFS_DEFAULT_BYTES_PER_INODE (16 * 1024)
+
+#define SIMPLEFS_INODES_PER_BLOCK \
+	(SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode))
+
+/* jbd2 will not use a log shorter than this */
+#define SIMPLEFS_MIN_JOURNAL_BLOCKS 1024
+#define SIMPLEFS_MAX_JOURNAL_BLOCKS 32768
+
+/* The jbd2 on-disk super block, big endian, as far as mkfs fills it in */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_FEATURE_INCOMPAT_REVOKE 0x1
+#define JBD2_FEATURE_INCOMPAT_64BIT 0x2
+
+struct jbd2_super {
+	uint32_t h_magic;
+	uint32_t h_blocktype;
+	uint32_t h_sequence;
+	uint32_t s_blocksize;
+	uint32_t s_maxlen;
+	uint32_t s_first;
+	uint32_t s_sequence;
+	uint32_t s_start;
+	int32_t s_errno;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	uint32_t s_nr_users;
+	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - 68];
+};
+
+/* Default log size: 1/32 of the image, within the limits above */
+static uint64_t default_journal_blocks(uint64_t size)
 {
-	struct simplefs_super_block sb = {
-		.version = 1,
-		.magic = SIMPLEFS_MAGIC,
-		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
-		/* One inode for rootdirectory and another for a welcome file that we are going to create */
-		.inodes_count = 2,
-		/* FIXME: Free blocks management is not implemented yet */
-		.imap = (~0) & ~0x3,
-		.dmap = (~0) & ~0x3,
-	};
+	uint64_t blocks = size / SIMPLEFS_DEFAULT_BLOCK_SIZE / 32;
+
+	if (blocks < SIMPLEFS_MIN_JOURNAL_BLOCKS)
+		blocks = SIMPLEFS_MIN_JOURNAL_BLOCKS;
+	if (blocks > SIMPLEFS_MAX_JOURNAL_BLOCKS)
+		blocks = SIMPLEFS_MAX_JOURNAL_BLOCKS;
+	return blocks;
+}
+
+/*
+ * Lay the image out.  @inodes is the requested inode count (0 to derive it
+ * from @bytes_per_inode); it is rounded up to fill whole inode table blocks.
+ * A journal of @journal_blocks, if any, sits between the table and the data.
+ */
+static void compute_layout(struct simplefs_super_block *sb, uint64_t size,
+		uint64_t inodes, uint64_t bytes_per_inode, uint64_t journal_blocks,
+		uint64_t blocks_per_group)
+{
+	uint64_t bits_per_block = SIMPLEFS_DEFAULT_BLOCK_SIZE * 8;
+
+	sb->blocks_count = size / SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	if (!inodes)
+		inodes = size / bytes_per_inode;
+	if (inodes < 2)
+		inodes = 2;
+
+	sb->inodestore_blocks = (inodes + SIMPLEFS_INODES_PER_BLOCK - 1) /
+		SIMPLEFS_INODES_PER_BLOCK;
+	sb->max_inodes = sb->inodestore_blocks * SIMPLEFS_INODES_PER_BLOCK;
+
+	sb->imap_block = SIMPLEFS_IMAP_BLOCK_NUMBER;
+	sb->imap_blocks = (sb->max_inodes + 1 + bits_per_block - 1) / bits_per_block;
+	sb->dmap_block = sb->imap_block + sb->imap_blocks;
+	sb->dmap_blocks = (sb->blocks_count + bits_per_block - 1) / bits_per_block;
+	sb->inodestore_block = sb->dmap_block + sb->dmap_blocks;
+	sb->journal_block = sb->inodestore_block + sb->inodestore_blocks;
+	sb->journal_blocks = journal_blocks;
+	sb->data_block = sb->journal_block + sb->journal_blocks;
+	sb->blocks_per_group = blocks_per_group;
+}
+
+/* Set bits [start, end) of @map, whole bytes at a time where possible */
+static void set_bits(uint8_t *map, uint64_t start, uint64_t end)
+{
+	for (; start < end && start % 8; start++)
+		map[start / 8] |= 1 << (start % 8);
+	if (end - start >= 8) {
+		memset(map + start / 8, 0xff, (end - start) / 8);
+		start += (end - start) / 8 * 8;
+	}
+	for (; start < end; start++)
+		map[start / 8] |= 1 << (start % 8);
+}
+
+/*
+ * Build everything up to the end of the first @table_blocks inode table
+ * blocks in one buffer: the super block, both bitmaps and @table.  The
+ * bitmaps have the inodes and blocks in use set, and the bits past the end
+ * so that those are never handed out.
+ */
+static uint8_t *build_head(const struct simplefs_super_block *sb,
+		const struct simplefs_inode *table, uint64_t table_blocks)
+{
+	size_t len = (sb->inodestore_block + table_blocks) * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	uint8_t *head = calloc(1, len);
+
+	if (!head)
+		return NULL;
+	memcpy(head, sb, sizeof(*sb));
+
+	set_bits(head + sb->imap_block * SIMPLEFS_DEFAULT_BLOCK_SIZE, 0,
+		 SIMPLEFS_ROOTDIR_INODE_NUMBER + sb->inodes_count);
+	set_bits(head + sb->imap_block * SIMPLEFS_DEFAULT_BLOCK_SIZE, sb->max_inodes + 1,
+		 sb->imap_blocks * SIMPLEFS_DEFAULT_BLOCK_SIZE * 8);
+	/* the data in use starts at the first data block */
+	set_bits(head + sb->dmap_block * SIMPLEFS_DEFAULT_BLOCK_SIZE, 0,
+		 sb->blocks_count - sb->free_blocks);
+	set_bits(head + sb->dmap_block * SIMPLEFS_DEFAULT_BLOCK_SIZE, sb->blocks_count,
+		 sb->dmap_blocks * SIMPLEFS_DEFAULT_BLOCK_SIZE * 8);
+
+	memcpy(head + sb->inodestore_block * SIMPLEFS_DEFAULT_BLOCK_SIZE, table,
+	       table_blocks * SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	return head;
+}
+
+static int write_head(int fd, const struct simplefs_super_block *sb,
+		const struct simplefs_inode *table, uint64_t table_blocks)
+{
+	size_t len = (sb->inodestore_block + table_blocks) * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	uint8_t *head = build_head(sb, table, table_blocks);
 	ssize_t ret;
 
-	ret = write(fd, &sb, sizeof(sb));
-	if (ret != SIMPLEFS_DEFAULT_BLOCK_SIZE) {
-		printf
-		    ("bytes written [%d] are not equal to the default block size\n",
-		     (int)ret);
+	if (!head) {
+		printf("Out of memory building the metadata\n");
 		return -1;
 	}
+	ret = pwrite(fd, head, len, 0);
+	free(head);
+	if (ret != (ssize_t)len) {
+		printf("Writing the super block, bitmaps and inodes has failed\n");
+		return -1;
+	}
+	printf("Super block, bitmaps and inode table written succesfully\n");
+	return 0;
+}
+
+/*
+ * Clear blocks [@start, @start + @count): the device zeroes them itself
+ * where it can, a regular file just gets a hole, and only failing both
+ * are zeros written, in large chunks.
+ */
+static int zero_blocks(int fd, int blockdev, uint64_t start, uint64_t count)
+{
+	uint64_t range[2] = { start * SIMPLEFS_DEFAULT_BLOCK_SIZE,
+			      count * SIMPLEFS_DEFAULT_BLOCK_SIZE };
+	uint64_t pos, end = range[0] + range[1];
+	size_t len;
+	char *zero;
 
-	printf("Super block written succesfully\n");
+	if (!count)
+		return 0;
+	if (blockdev && !ioctl(fd, BLKZEROOUT, range))
+		return 0;
+	if (!blockdev && !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				    range[0], range[1]))
+		return 0;
+
+	zero = calloc(1, SIMPLEFS_ZERO_CHUNK);
+	if (!zero)
+		return -1;
+	for (pos = range[0]; pos < end; pos += len) {
+		len = end - pos < SIMPLEFS_ZERO_CHUNK ? end - pos : SIMPLEFS_ZERO_CHUNK;
+		if (pwrite(fd, zero, len, pos) != (ssize_t)len) {
+			free(zero);
+			return -1;
+		}
+	}
+	free(zero);
 	return 0;
 }
 
-static int write_inode_store(int fd)
+/*
+ * Write an empty log: a jbd2 super block with s_start 0 in the first
+ * journal block, the rest already cleared.
+ */
+static int write_journal(int fd, const struct simplefs_super_block *sb)
 {
-	ssize_t ret;
+	struct jbd2_super jsb;
+	int rfd;
 
-	struct simplefs_inode root_inode;
+	if (!sb->journal_blocks)
+		return 0;
 
-	root_inode.mode = S_IFDIR;
-	root_inode.i_nlink = 1;
-	root_inode.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
-	root_inode.data_block_number = SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER;
-	root_inode.dir_children_count = 1;
+	memset(&jsb, 0, sizeof(jsb));
+	jsb.h_magic = htonl(JBD2_MAGIC_NUMBER);
+	jsb.h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+	jsb.s_blocksize = htonl(SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	/* journal block numbers are relative to sb->journal_block */
+	jsb.s_maxlen = htonl(sb->journal_blocks);
+	jsb.s_first = htonl(1);
+	jsb.s_sequence = htonl(1);
+	jsb.s_feature_incompat = htonl(JBD2_FEATURE_INCOMPAT_REVOKE |
+			(sb->blocks_count > UINT32_MAX ? JBD2_FEATURE_INCOMPAT_64BIT : 0));
+	jsb.s_nr_users = htonl(1);
+	rfd = open("/dev/urandom", O_RDONLY);
+	if (rfd == -1 || read(rfd, jsb.s_uuid, sizeof(jsb.s_uuid)) != sizeof(jsb.s_uuid))
+		printf("No random uuid for the journal, leaving it zero\n");
+	if (rfd != -1)
+		close(rfd);
 
-	ret = write(fd, &root_inode, sizeof(root_inode));
+	if (pwrite(fd, &jsb, sizeof(jsb), sb->journal_block * SIMPLEFS_DEFAULT_BLOCK_SIZE) !=
+	    sizeof(jsb)) {
+		printf("Writing the journal super block has failed\n");
+		return -1;
+	}
+	printf("journal of %llu blocks written succesfully\n",
+	       (unsigned long long)sb->journal_blocks);
+	return 0;
+}
+
+/* The root directory block: one record for @name spanning the whole block */
+int write_dirent(int fd, const struct simplefs_super_block *sb,
+		uint64_t ino, const char *name, uint8_t file_type)
+{
+	char block[SIMPLEFS_DEFAULT_BLOCK_SIZE] = { 0 };
+	struct simplefs_dir_record *record = (struct simplefs_dir_record *)block;
+	ssize_t ret;
+
+	record->inode_no = ino;
+	record->rec_len = sizeof(block);
+	record->name_len = strlen(name);
+	record->file_type = file_type;
+	memcpy(record->filename, name, record->name_len);
 
-	if (ret != sizeof(root_inode)) {
+	ret = pwrite(fd, block, sizeof(block), sb->data_block * SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	if (ret != sizeof(block)) {
 		printf
-		    ("The inode store was not written properly. Retry your mkfs\n");
+		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
 		return -1;
 	}
+	printf
+	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
+	return 0;
+}
+
+/*
+ * mkfs-simplefs -d: build the filesystem from a source tree instead of
+ * the welcome file.  The tree is walked depth first, each directory in
+ * name hash order, which is the order readdir returns names in; inode
+ * numbers and data blocks are handed out in that same order, so the
+ * inode table, the directory blocks and the file data of a walk such as
+ * tar or cp -r are read front to back.  Small files and short symlink
+ * targets live in their inodes as the kernel keeps them; hard links
+ * within the tree share one inode.  Only mode and times are kept, there
+ * being no owner on disk, and other file types are skipped.
+ */
+
+/* Bytes copied at a time where copy_file_range() cannot be used */
+#define SIMPLEFS_COPY_CHUNK (1024 * 1024)
+
+struct src_entry {
+	char *name;
+	uint8_t len;
+	uint32_t hash;
+	char *path;
+	struct stat st;
+	struct src_inode *inode;
+};
+
+struct src_inode {
+	uint64_t ino;
+	struct stat st;
+	uint16_t nlink;
+	char *path;		/* regular files, to copy from */
+	char *target;		/* symlinks */
+	uint64_t start;		/* first block, counted from sb->data_block */
+	uint64_t blocks;
+	struct src_entry *entries;	/* directories, in hash order */
+	unsigned int nentries;
+	uint32_t leaves;
+};
+
+struct src_tree {
+	struct src_inode **inodes;	/* by inode number, from the root */
+	uint64_t count, cap;
+	uint64_t blocks;
+	void *links;		/* files with more than one name, by st_dev/st_ino */
+};
+
+/* Must match simplefs_dirhash() in htree.c */
+static uint32_t dirhash(const unsigned char *name, int len)
+{
+	uint32_t hash = 0x811c9dc5;
+
+	while (len--) {
+		hash ^= *name++;
+		hash *= 0x01000193;
+	}
+	return hash % SIMPLEFS_HASH_EOF;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct src_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+static int link_cmp(const void *a, const void *b)
+{
+	const struct src_inode *x = a, *y = b;
 
-	printf("root directory inode written succesfully\n");
+	if (x->st.st_dev != y->st.st_dev)
+		return x->st.st_dev < y->st.st_dev ? -1 : 1;
+	if (x->st.st_ino != y->st.st_ino)
+		return x->st.st_ino < y->st.st_ino ? -1 : 1;
 	return 0;
 }
 
-static int write_inode(int fd, const struct simplefs_inode *i)
+static uint8_t src_ftype(mode_t mode)
 {
-	off_t nbytes;
-	ssize_t ret;
+	if (S_ISDIR(mode))
+		return SIMPLEFS_FT_DIR;
+	if (S_ISLNK(mode))
+		return SIMPLEFS_FT_SYMLINK;
+	return SIMPLEFS_FT_REG_FILE;
+}
 
-	ret = write(fd, i, sizeof(*i));
-	if (ret != sizeof(*i)) {
-		printf
-		    ("The welcomefile inode was not written properly. Retry your mkfs\n");
+/*
+ * Pack the names of @dir into leaves, in hash order and never splitting
+ * names that share a hash between two leaves.  The records go to @buf and
+ * the first hash of each leaf to @hash, when those are not NULL.  Returns
+ * the number of leaves, 0 if a run of equal hashes overflows a leaf.
+ */
+static uint32_t pack_leaves(const struct src_inode *dir, uint8_t *buf, uint32_t *hash)
+{
+	struct simplefs_dir_record *rec = NULL;
+	unsigned int i, j, k, run, used = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	uint32_t leaves = 0;
+
+	for (i = 0; i < dir->nentries; i = j) {
+		run = 0;
+		for (j = i; j < dir->nentries && dir->entries[j].hash == dir->entries[i].hash; j++)
+			run += SIMPLEFS_DIR_REC_LEN(dir->entries[j].len);
+		if (run > SIMPLEFS_DEFAULT_BLOCK_SIZE)
+			return 0;
+		if (used + run > SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+			/* the last record of a leaf reaches to its end */
+			if (rec)
+				rec->rec_len += SIMPLEFS_DEFAULT_BLOCK_SIZE - used;
+			if (hash)
+				hash[leaves] = dir->entries[i].hash;
+			leaves++;
+			used = 0;
+		}
+		for (k = i; k < j; k++) {
+			if (buf) {
+				rec = (struct simplefs_dir_record *)(buf +
+					(leaves - 1) * SIMPLEFS_DEFAULT_BLOCK_SIZE + used);
+				rec->inode_no = dir->entries[k].inode->ino;
+				rec->rec_len = SIMPLEFS_DIR_REC_LEN(dir->entries[k].len);
+				rec->name_len = dir->entries[k].len;
+				rec->file_type = src_ftype(dir->entries[k].inode->st.st_mode);
+				memcpy(rec->filename, dir->entries[k].name, rec->name_len);
+			}
+			used += SIMPLEFS_DIR_REC_LEN(dir->entries[k].len);
+		}
+	}
+	if (rec)
+		rec->rec_len += SIMPLEFS_DEFAULT_BLOCK_SIZE - used;
+	return leaves;
+}
+
+/* Index nodes between the root and the leaves of an indexed directory */
+static uint32_t dx_nodes(uint32_t leaves)
+{
+	if (leaves <= SIMPLEFS_DX_LIMIT)
+		return 0;
+	return (leaves + SIMPLEFS_DX_LIMIT - 1) / SIMPLEFS_DX_LIMIT;
+}
+
+/*
+ * Size @dir as the kernel would read it: one leaf, or an index root in
+ * block 0 followed by the index nodes and then the leaves
+ */
+static int size_dir(struct src_inode *dir, const char *path)
+{
+	if (!dir->nentries)
+		return 0;
+	dir->leaves = pack_leaves(dir, NULL, NULL);
+	if (!dir->leaves || dx_nodes(dir->leaves) > SIMPLEFS_DX_LIMIT) {
+		printf("%s: too many names for one directory\n", path);
 		return -1;
 	}
-	printf("welcomefile inode written succesfully\n");
+	dir->blocks = dir->leaves == 1 ? 1 : 1 + dx_nodes(dir->leaves) + dir->leaves;
+	return 0;
+}
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(*i) - sizeof(*i);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf
-		    ("The padding bytes are not written properly. Retry your mkfs\n");
+/* Fill the dir->blocks zeroed blocks at @buf */
+static int build_dir(const struct src_inode *dir, uint8_t *buf)
+{
+	uint32_t nodes = dx_nodes(dir->leaves), i, *hash;
+	struct simplefs_dx_node *root = (struct simplefs_dx_node *)buf, *node;
+
+	if (dir->blocks == 1) {
+		pack_leaves(dir, buf, NULL);
+		return 0;
+	}
+	hash = malloc(dir->leaves * sizeof(*hash));
+	if (!hash)
 		return -1;
+	pack_leaves(dir, buf + (1 + nodes) * SIMPLEFS_DEFAULT_BLOCK_SIZE, hash);
+	/* the first entry covers everything below the second */
+	hash[0] = 0;
+
+	if (!nodes) {
+		root->dx_count = dir->leaves;
+		for (i = 0; i < dir->leaves; i++) {
+			root->dx_entry[i].hash = hash[i];
+			root->dx_entry[i].block = 1 + i;
+		}
+		free(hash);
+		return 0;
 	}
+	root->dx_levels = 1;
+	root->dx_count = nodes;
+	for (i = 0; i < dir->leaves; i++) {
+		node = (struct simplefs_dx_node *)(buf +
+			(1 + i / SIMPLEFS_DX_LIMIT) * SIMPLEFS_DEFAULT_BLOCK_SIZE);
+		if (i % SIMPLEFS_DX_LIMIT == 0) {
+			root->dx_entry[i / SIMPLEFS_DX_LIMIT].hash = hash[i];
+			root->dx_entry[i / SIMPLEFS_DX_LIMIT].block = 1 + i / SIMPLEFS_DX_LIMIT;
+		}
+		node->dx_entry[node->dx_count].hash = hash[i];
+		node->dx_entry[node->dx_count++].block = 1 + nodes + i;
+	}
+	free(hash);
+	return 0;
+}
 
-	printf
-	    ("inode store padding bytes (after the two inodes) written sucessfully\n");
+/* Give @entry its inode, a new one unless it is another name of a file seen before */
+static struct src_inode *src_inode(struct src_tree *t, struct src_entry *entry)
+{
+	struct src_inode *inode, **found;
+
+	inode = calloc(1, sizeof(*inode));
+	if (!inode)
+		return NULL;
+	inode->st = entry->st;
+	if (!S_ISDIR(entry->st.st_mode) && entry->st.st_nlink > 1) {
+		found = tsearch(inode, &t->links, link_cmp);
+		if (!found) {
+			free(inode);
+			return NULL;
+		}
+		if (*found != inode) {
+			free(inode);
+			if ((*found)->nlink == UINT16_MAX) {
+				printf("%s: too many links\n", entry->path);
+				return NULL;
+			}
+			(*found)->nlink++;
+			return *found;
+		}
+	}
+	if (t->count == t->cap) {
+		struct src_inode **inodes;
+
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		inodes = realloc(t->inodes, t->cap * sizeof(*inodes));
+		if (!inodes) {
+			free(inode);
+			return NULL;
+		}
+		t->inodes = inodes;
+	}
+	t->inodes[t->count++] = inode;
+	inode->ino = t->count;
+	inode->nlink = 1;
+	return inode;
+}
+
+/* Give @inode, which @entry names, the blocks its data needs */
+static int place_inode(struct src_tree *t, struct src_inode *inode, struct src_entry *entry)
+{
+	char target[SIMPLEFS_DEFAULT_BLOCK_SIZE];
+	ssize_t len;
+
+	if (S_ISREG(inode->st.st_mode)) {
+		inode->path = entry->path;
+		entry->path = NULL;
+		if (inode->st.st_size > SIMPLEFS_INLINE_SIZE)
+			inode->blocks = (inode->st.st_size + SIMPLEFS_DEFAULT_BLOCK_SIZE - 1) /
+				SIMPLEFS_DEFAULT_BLOCK_SIZE;
+		if (inode->blocks > 2 * (uint64_t)SIMPLEFS_EXT_MAX_LEN) {
+			printf("%s: too large\n", inode->path);
+			return -1;
+		}
+	} else if (S_ISLNK(inode->st.st_mode)) {
+		len = readlink(entry->path, target, sizeof(target));
+		if (len <= 0 || len >= (ssize_t)sizeof(target)) {
+			printf("%s: unusable symlink target\n", entry->path);
+			return -1;
+		}
+		inode->target = strndup(target, len);
+		if (!inode->target)
+			return -1;
+		inode->st.st_size = len;
+		if (len >= SIMPLEFS_INLINE_SIZE)
+			inode->blocks = 1;
+	}
+	inode->start = t->blocks;
+	t->blocks += inode->blocks;
 	return 0;
 }
-int write_dirent(int fd, const struct simplefs_dir_record *record)
+
+/*
+ * Read the names in @path, the source of @dir, then place @dir and, in
+ * hash order, what they name, descending into subdirectories on the way
+ */
+static int scan_dir(struct src_tree *t, struct src_inode *dir, const char *path)
 {
-	ssize_t nbytes = sizeof(*record), ret;
+	struct src_entry *entry;
+	struct dirent *de;
+	unsigned int cap = 0, i;
+	size_t len;
+	DIR *d;
 
-	ret = write(fd, record, nbytes);
-	if (ret != nbytes) {
-		printf
-		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
+	d = opendir(path);
+	if (!d) {
+		perror(path);
 		return -1;
 	}
-	printf
-	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		len = strlen(de->d_name);
+		if (len > SIMPLEFS_FILENAME_MAXLEN) {
+			printf("%s/%s: name too long\n", path, de->d_name);
+			goto fail;
+		}
+		if (dir->nentries == cap) {
+			cap = cap ? cap * 2 : 16;
+			entry = realloc(dir->entries, cap * sizeof(*entry));
+			if (!entry)
+				goto fail;
+			dir->entries = entry;
+		}
+		entry = &dir->entries[dir->nentries];
+		memset(entry, 0, sizeof(*entry));
+		if (asprintf(&entry->path, "%s/%s", path, de->d_name) == -1)
+			goto fail;
+		if (lstat(entry->path, &entry->st) == -1) {
+			perror(entry->path);
+			free(entry->path);
+			goto fail;
+		}
+		if (!S_ISREG(entry->st.st_mode) && !S_ISDIR(entry->st.st_mode) &&
+		    !S_ISLNK(entry->st.st_mode)) {
+			printf("Skipping %s, neither a file, a directory nor a symlink\n",
+			       entry->path);
+			free(entry->path);
+			continue;
+		}
+		entry->name = entry->path + strlen(path) + 1;
+		entry->len = len;
+		entry->hash = dirhash((unsigned char *)entry->name, len);
+		dir->nentries++;
+	}
+	closedir(d);
+	d = NULL;
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf
-		    ("Writing the padding for rootdirectory children datablock has failed\n");
+	qsort(dir->entries, dir->nentries, sizeof(*dir->entries), entry_cmp);
+	if (size_dir(dir, path))
+		goto fail;
+	dir->start = t->blocks;
+	t->blocks += dir->blocks;
+
+	for (i = 0; i < dir->nentries; i++) {
+		entry = &dir->entries[i];
+		entry->inode = src_inode(t, entry);
+		if (!entry->inode)
+			goto fail;
+		if (entry->inode->nlink > 1)
+			continue;
+		if (S_ISDIR(entry->inode->st.st_mode)) {
+			if (scan_dir(t, entry->inode, entry->path))
+				goto fail;
+		} else if (place_inode(t, entry->inode, entry)) {
+			goto fail;
+		}
+	}
+	return 0;
+fail:
+	if (d)
+		closedir(d);
+	return -1;
+}
+
+/* Map the @blocks blocks from @start of @raw, in as few extents as they fit in */
+static void set_extents(struct simplefs_inode *raw, uint64_t start, uint64_t blocks)
+{
+	uint32_t len;
+
+	for (; blocks; blocks -= len, start += len) {
+		len = blocks < SIMPLEFS_EXT_MAX_LEN ? blocks : SIMPLEFS_EXT_MAX_LEN;
+		raw->i_extent[raw->i_extent_count].ee_block =
+			raw->i_extent_count ? SIMPLEFS_EXT_MAX_LEN : 0;
+		raw->i_extent[raw->i_extent_count].ee_len = len;
+		raw->i_extent[raw->i_extent_count++].ee_start = start;
+	}
+}
+
+static int fill_inode(struct simplefs_inode *raw, const struct src_inode *inode,
+		uint64_t data_block)
+{
+	int fd;
+
+	raw->mode = inode->st.st_mode;
+	raw->i_nlink = inode->nlink;
+	raw->inode_no = inode->ino;
+	raw->i_atime = inode->st.st_atim.tv_sec;
+	raw->i_atime_nsec = inode->st.st_atim.tv_nsec;
+	raw->i_mtime = inode->st.st_mtim.tv_sec;
+	raw->i_mtime_nsec = inode->st.st_mtim.tv_nsec;
+	raw->i_ctime = inode->st.st_ctim.tv_sec;
+	raw->i_ctime_nsec = inode->st.st_ctim.tv_nsec;
+	set_extents(raw, data_block + inode->start, inode->blocks);
+
+	if (S_ISDIR(inode->st.st_mode)) {
+		raw->dir_children_count = inode->nentries;
+		if (inode->blocks > 1)
+			raw->i_flags |= SIMPLEFS_INDEX_FL;
+		return 0;
+	}
+	raw->file_size = inode->st.st_size;
+	if (inode->blocks)
+		return 0;
+	raw->i_flags |= SIMPLEFS_INLINE_DATA_FL;
+	if (S_ISLNK(inode->st.st_mode)) {
+		memcpy(raw->i_data, inode->target, inode->st.st_size);
+		return 0;
+	}
+	if (!inode->st.st_size)
+		return 0;
+	fd = open(inode->path, O_RDONLY);
+	if (fd == -1 || read(fd, raw->i_data, inode->st.st_size) != inode->st.st_size) {
+		printf("Reading %s has failed\n", inode->path);
+		if (fd != -1)
+			close(fd);
 		return -1;
 	}
-	printf
-	    ("padding after the rootdirectory children written succesfully\n");
+	close(fd);
 	return 0;
 }
-int write_block(int fd, char *block, size_t len)
+
+/*
+ * Copy @len bytes of @src to @pos in the image, with copy_file_range()
+ * where the kernel can do it between the two, which also lets it share
+ * the blocks of an image on the same filesystem
+ */
+static int copy_data(int fd, int src, uint64_t pos, uint64_t len)
 {
-	ssize_t ret;
+	loff_t in = 0, out = pos;
+	char *buf = NULL;
+	ssize_t n = -1;
+
+	while (len) {
+		n = copy_file_range(src, &in, fd, &out, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+	if (len && n == -1 && (errno == EXDEV || errno == EINVAL ||
+			       errno == ENOSYS || errno == EOPNOTSUPP)) {
+		buf = malloc(SIMPLEFS_COPY_CHUNK);
+		while (buf && len) {
+			n = pread(src, buf, len < SIMPLEFS_COPY_CHUNK ? len : SIMPLEFS_COPY_CHUNK, in);
+			if (n <= 0 || pwrite(fd, buf, n, out) != n)
+				break;
+			in += n;
+			out += n;
+			len -= n;
+		}
+		free(buf);
+	}
+	return len ? -1 : 0;
+}
+
+/* Write the data of @inode to its blocks */
+static int write_data(int fd, const struct src_inode *inode, uint64_t data_block)
+{
+	uint64_t pos = (data_block + inode->start) * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	uint64_t len = inode->blocks * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	static const char zero[SIMPLEFS_DEFAULT_BLOCK_SIZE];
+	uint8_t *buf;
+	int src, ret;
+
+	if (S_ISREG(inode->st.st_mode)) {
+		src = open(inode->path, O_RDONLY);
+		if (src == -1) {
+			perror(inode->path);
+			return -1;
+		}
+		ret = copy_data(fd, src, pos, inode->st.st_size);
+		close(src);
+		if (ret) {
+			printf("Copying %s has failed\n", inode->path);
+			return -1;
+		}
+		/* what the device held past the end of the file must read as zeros */
+		len -= inode->st.st_size;
+		if (len && pwrite(fd, zero, len, pos + inode->st.st_size) != (ssize_t)len) {
+			printf("Writing the last block of %s has failed\n", inode->path);
+			return -1;
+		}
+		return 0;
+	}
+
+	buf = calloc(1, len);
+	if (!buf)
+		return -1;
+	ret = 0;
+	if (S_ISDIR(inode->st.st_mode))
+		ret = build_dir(inode, buf);
+	else
+		memcpy(buf, inode->target, inode->st.st_size);
+	if (!ret && pwrite(fd, buf, len, pos) != (ssize_t)len)
+		ret = -1;
+	free(buf);
+	if (ret)
+		printf("Writing the blocks of inode %llu has failed\n",
+		       (unsigned long long)inode->ino);
+	return ret;
+}
+
+/* Walk @srcdir, making it the root directory */
+static int scan_tree(struct src_tree *t, const char *srcdir)
+{
+	struct src_entry root = { .path = strdup(srcdir) };
+
+	if (!root.path)
+		return -1;
+	if (stat(srcdir, &root.st) == -1) {
+		perror(srcdir);
+		return -1;
+	}
+	if (!S_ISDIR(root.st.st_mode)) {
+		printf("%s is not a directory\n", srcdir);
+		return -1;
+	}
+	if (!src_inode(t, &root))
+		return -1;
+	return scan_dir(t, t->inodes[0], root.path);
+}
+
+static int write_tree(int fd, const struct src_tree *t, uint64_t data_block)
+{
+	uint64_t i;
+
+	for (i = 0; i < t->count; i++) {
+		if (t->inodes[i]->blocks && write_data(fd, t->inodes[i], data_block))
+			return -1;
+	}
+	printf("%llu inodes and %llu data blocks from the source tree written succesfully\n",
+	       (unsigned long long)t->count, (unsigned long long)t->blocks);
+	return 0;
+}
+
+/*
+ * Find how much of the device to use: *size if the caller asked for a
+ * size, or all of it.  An image file is grown to the size wanted, at
+ * least SIMPLEFS_DEFAULT_IMAGE_SIZE.
+ */
+static int device_size(int fd, uint64_t *size, int *blockdev)
+{
+	uint64_t want = *size;
+	struct stat st;
 
-	ret = write(fd, block, len);
-	if (ret != len) {
-		printf("Writing file body has failed\n");
+	if (fstat(fd, &st) == -1) {
+		perror("Error querying the device");
 		return -1;
 	}
-	printf("block has been written succesfully\n");
+	*blockdev = S_ISBLK(st.st_mode);
+	if (*blockdev) {
+		if (ioctl(fd, BLKGETSIZE64, size) == -1) {
+			perror("Error querying the device size");
+			return -1;
+		}
+		if (want > *size) {
+			printf("The device is only %llu bytes\n", (unsigned long long)*size);
+			return -1;
+		}
+		if (want)
+			*size = want;
+		return 0;
+	}
+
+	*size = want ? want : (uint64_t)st.st_size;
+	if (*size < SIMPLEFS_DEFAULT_IMAGE_SIZE)
+		*size = SIMPLEFS_DEFAULT_IMAGE_SIZE;
+	if ((uint64_t)st.st_size < *size && ftruncate(fd, *size) == -1) {
+		perror("Error sizing the image");
+		return -1;
+	}
+	return 0;
+}
+
+/* A byte count with an optional K, M, G or T suffix */
+static int parse_size(const char *arg, uint64_t *size)
+{
+	char *end;
+	int shift = 0;
+
+	*size = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'T': case 't':
+		shift += 10;
+		/* fall through */
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	if (*end || !*size || *size > UINT64_MAX >> shift)
+		return -1;
+	*size <<= shift;
 	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	int fd;
+	int fd, opt, blockdev;
 	ssize_t ret;
+	uint64_t size = 0, want_size, device_bytes;
+	uint64_t inodes = 0, bytes_per_inode = SIMPLEFS_DEFAULT_BYTES_PER_INODE;
+	uint64_t journal_blocks = 0, blocks_per_group = SIMPLEFS_BLOCKS_PER_GROUP;
+	int journal = 0, zero_itable = 0;
+	uint64_t itable_end, table_blocks, data_used = 1, needed = 2, i;
+	struct simplefs_inode *table = NULL;
+	struct src_tree tree = { 0 };
+	char *end, *srcdir = NULL;
+	struct simplefs_super_block sb = {
+		.version = SIMPLEFS_VERSION,
+		.magic = SIMPLEFS_MAGIC,
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		/* One inode for rootdirectory and another for a welcome file that we are going to create */
+		.inodes_count = 2,
+	};
 
 	char welcomefile_body[] = "Love is God. God is Love. Anbe Murugan.\n";
+	/* small enough to live in the inode, no data block needed */
 	struct simplefs_inode welcome = {
 		.mode = S_IFREG,
+		.i_flags = SIMPLEFS_INLINE_DATA_FL,
 		.i_nlink = 1,
 		.inode_no = WELCOMEFILE_INODE_NUMBER,
-		.data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
 		.file_size = sizeof(welcomefile_body),
 	};
-	struct simplefs_dir_record record = {
-		.filename = "vanakkam",
-		.inode_no = WELCOMEFILE_INODE_NUMBER,
-	};
 
-	if (argc != 2) {
-		printf("Usage: mkfs-simplefs <device>\n");
+	while ((opt = getopt(argc, argv, "b:s:g:N:i:jJ:zd:")) != -1) {
+		switch (opt) {
+		case 'b':
+			/* the kernel maps a block to a page */
+			if (strtoull(optarg, &end, 0) != SIMPLEFS_DEFAULT_BLOCK_SIZE || *end) {
+				printf("Only %d-byte blocks are supported\n",
+				       SIMPLEFS_DEFAULT_BLOCK_SIZE);
+				return -1;
+			}
+			break;
+		case 's':
+			if (parse_size(optarg, &size) || size < SIMPLEFS_DEFAULT_BLOCK_SIZE) {
+				printf("Bad image size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'g':
+			blocks_per_group = strtoull(optarg, &end, 0);
+			if (*end || blocks_per_group < SIMPLEFS_MIN_BLOCKS_PER_GROUP ||
+			    blocks_per_group > SIMPLEFS_MAX_BLOCKS_PER_GROUP ||
+			    (blocks_per_group & (blocks_per_group - 1))) {
+				printf("Bad group size %s, a power of two from %d to %d blocks\n",
+				       optarg, SIMPLEFS_MIN_BLOCKS_PER_GROUP,
+				       SIMPLEFS_MAX_BLOCKS_PER_GROUP);
+				return -1;
+			}
+			break;
+		case 'N':
+			inodes = strtoull(optarg, &end, 0);
+			if (*end || !inodes) {
+				printf("Bad inode count %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			bytes_per_inode = strtoull(optarg, &end, 0);
+			if (*end || !bytes_per_inode) {
+				printf("Bad bytes-per-inode ratio %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'j':
+			journal = 1;
+			break;
+		case 'J':
+			journal = 1;
+			journal_blocks = strtoull(optarg, &end, 0);
+			if (*end || journal_blocks < SIMPLEFS_MIN_JOURNAL_BLOCKS ||
+			    journal_blocks > UINT32_MAX) {
+				printf("Bad journal size %s, at least %d blocks\n",
+				       optarg, SIMPLEFS_MIN_JOURNAL_BLOCKS);
+				return -1;
+			}
+			break;
+		case 'z':
+			zero_itable = 1;
+			break;
+		case 'd':
+			srcdir = optarg;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+
+	if (optind != argc - 1) {
+		printf("Usage: mkfs-simplefs [-b block-size] [-s size] [-g blocks-per-group] "
+		       "[-N inodes] [-i bytes-per-inode] [-j] [-J journal-blocks] [-z] "
+		       "[-d source-dir] <device>\n");
 		return -1;
 	}
 
-	fd = open(argv[1], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (srcdir) {
+		if (scan_tree(&tree, srcdir))
+			return -1;
+		needed = tree.count;
+		data_used = tree.blocks;
+	}
+	if (inodes && inodes < needed) {
+		printf("%llu inodes are too few, %llu are needed\n",
+		       (unsigned long long)inodes, (unsigned long long)needed);
+		return -1;
+	}
+	/* an image file for a source tree is grown to hold it, unless sized with -s */
+	want_size = size;
+
+	fd = open(argv[optind], O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
@@ -155,24 +987,95 @@ int main(int argc, char *argv[])
 
 	ret = 1;
 	do {
-		if (write_superblock(fd))
+		if (device_size(fd, &size, &blockdev))
 			break;
-		if (write_inode_store(fd))
+		if (journal && !journal_blocks)
+			journal_blocks = default_journal_blocks(size);
+		device_bytes = size;
+		for (;;) {
+			compute_layout(&sb, size, inodes ? inodes :
+				       size / bytes_per_inode > needed ? size / bytes_per_inode : needed,
+				       bytes_per_inode, journal_blocks, blocks_per_group);
+			if (sb.data_block + data_used <= sb.blocks_count || blockdev ||
+			    want_size || !srcdir)
+				break;
+			size = (sb.data_block + data_used) * SIMPLEFS_DEFAULT_BLOCK_SIZE;
+		}
+		if (sb.data_block + data_used > sb.blocks_count) {
+			printf("The device is too small\n");
 			break;
-		if (write_inode(fd, &welcome))
+		}
+		if (size > device_bytes && ftruncate(fd, size) == -1) {
+			perror("Error sizing the image");
 			break;
-#if 1
-		if (write_dirent(fd, &record))
+		}
+
+		/* the root directory and everything under it, from the first data block */
+		sb.inodes_count = needed;
+		sb.free_inodes = sb.max_inodes - sb.inodes_count;
+		sb.free_blocks = sb.blocks_count - sb.data_block - data_used;
+		table_blocks = (sb.inodes_count + SIMPLEFS_INODES_PER_BLOCK - 1) /
+			SIMPLEFS_INODES_PER_BLOCK;
+		table = calloc(table_blocks, SIMPLEFS_DEFAULT_BLOCK_SIZE);
+		if (!table) {
+			printf("Out of memory building the inode table\n");
 			break;
-#endif
-		if (write_block(fd, welcomefile_body, welcome.file_size))
+		}
+		for (i = 0; i < tree.count; i++) {
+			if (fill_inode(&table[i], tree.inodes[i], sb.data_block))
+				break;
+		}
+		if (i < tree.count)
 			break;
+		if (!srcdir) {
+			table->mode = S_IFDIR;
+			table->i_nlink = 1;
+			table->inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
+			table->i_extent_count = 1;
+			table->i_extent[0].ee_block = 0;
+			table->i_extent[0].ee_len = 1;
+			table->i_extent[0].ee_start = sb.data_block;
+			table->dir_children_count = 1;
+			table->i_atime = table->i_mtime = table->i_ctime = time(NULL);
+			memcpy(welcome.i_data, welcomefile_body, sizeof(welcomefile_body));
+			welcome.i_atime = welcome.i_mtime = welcome.i_ctime = time(NULL);
+			table[welcome.inode_no - SIMPLEFS_ROOTDIR_INODE_NUMBER] = welcome;
+		}
+
+		/*
+		 * Clear what a previous filesystem left in the table and the
+		 * log.  On a block device the table past the blocks written
+		 * here is left for the kernel to zero after mount, unless -z.
+		 */
+		itable_end = sb.inodestore_block + sb.inodestore_blocks;
+		if (blockdev && !zero_itable && sb.inodestore_blocks > table_blocks)
+			sb.itable_uninit = table_blocks;
+		else if (zero_blocks(fd, blockdev, sb.inodestore_block + table_blocks,
+				     sb.inodestore_blocks - table_blocks)) {
+			printf("Clearing the inode store has failed\n");
+			break;
+		}
+		if (zero_blocks(fd, blockdev, itable_end, sb.data_block - itable_end)) {
+			printf("Clearing the journal has failed\n");
+			break;
+		}
+		if (write_head(fd, &sb, table, table_blocks))
+			break;
+		if (write_journal(fd, &sb))
+			break;
+		if (srcdir ? write_tree(fd, &tree, sb.data_block) :
+		    write_dirent(fd, &sb, WELCOMEFILE_INODE_NUMBER, "vanakkam",
+				 SIMPLEFS_FT_REG_FILE))
+			break;
+		if (fsync(fd) == -1) {
+			perror("Error syncing the device");
+			break;
+		}
 
 		ret = 0;
 	} while (0);
 
-	ftruncate(fd, 4096 * 1024);
-
+	free(table);
 	close(fd);
 	return ret;
 }
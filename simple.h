@@ -1,9 +1,16 @@
 #ifndef __SIMPLE_H__
 #define __SIMPLE_H__
 
+#include <linux/jbd2.h>
+#include <linux/xarray.h>
+#include <linux/percpu_counter.h>
+
 #define SIMPLEFS_MAGIC 0x10032013
+/* bumped when the on-disk layout changes; 2: 128-byte inodes,
+ * 3: variable-length directory records, 4: 256-byte inodes with times */
+#define SIMPLEFS_VERSION 4
 #define SIMPLEFS_DEFAULT_BLOCK_SIZE 4096
-#define SIMPLEFS_FILENAME_MAXLEN 24
+#define SIMPLEFS_FILENAME_MAXLEN 255
 #define SIMPLEFS_START_INO 10
 #define SIMPLEFS_ROOTDIR_INO 1
 /**
@@ -28,56 +35,145 @@
 /* Hard-coded inode number for the root directory */
 #define SIMPLEFS_ROOTDIR_INODE_NUMBER		1
 
-#define SIMPLEFS_LAST_INODE_NUMBER		64
-
 /* The disk block where super block is stored */
 #define SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER	0
 
-/* The disk block where the inodes are stored */
-#define SIMPLEFS_INODESTORE_BLOCK_NUMBER	1
-
-/* The disk block where the name+inode_number pairs of the
- * contents of the root directory are stored */
-#define SIMPLEFS_START_DATABLOCK_NUMBER		2
-#define SIMPLEFS_END_DATABLOCK_NUMBER		66
+/* The first inode bitmap block; the block bitmap, the inode store and
+ * the data blocks follow at offsets recorded in the super block */
+#define SIMPLEFS_IMAP_BLOCK_NUMBER		1
 
 /* The name+inode_number pair for each file in a directory.
- * This gets stored as the data for a directory */
+ * This gets stored as the data for a directory: each block is a chain of
+ * records reaching exactly to its end, rec_len leading from one to the
+ * next.  A record may have slack after its name, and one with a zero
+ * inode_no is free space. */
 struct simplefs_dir_record {
 	uint64_t inode_no;
-	char filename[SIMPLEFS_FILENAME_MAXLEN];
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;	/* FT_* of fs_types.h, as in ext2 */
+	char filename[];	/* name_len bytes, no NUL */
+};
+
+/* Records start 8-byte aligned */
+#define SIMPLEFS_DIR_REC_LEN(name_len) \
+	((offsetof(struct simplefs_dir_record, filename) + (name_len) + 7) & ~7)
+
+#define SIMPLEFS_DIR_RECORDS_PER_BLOCK \
+	(SIMPLEFS_DEFAULT_BLOCK_SIZE / SIMPLEFS_DIR_REC_LEN(1))
+
+/* Directories flagged SIMPLEFS_INDEX_FL keep the root of a hash index in
+ * block 0.  Each index block holds simplefs_dx_entry pairs sorted by hash;
+ * an entry covers the names hashing from its hash up to the next one. */
+struct simplefs_dx_entry {
+	uint32_t hash;
+	uint32_t block;		/* logical block in the directory */
 };
 
+struct simplefs_dx_node {
+	uint16_t dx_count;
+	uint8_t dx_levels;	/* root only: index node levels below the root */
+	uint8_t dx_reserved;
+	uint32_t dx_reserved2;
+	struct simplefs_dx_entry dx_entry[];
+};
+
+#define SIMPLEFS_DX_LIMIT \
+	((SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(struct simplefs_dx_node)) / sizeof(struct simplefs_dx_entry))
+#define SIMPLEFS_DX_MAX_LEVELS 1
+
+/* Name hashes lie below this value, which readdir uses as its end cookie */
+#define SIMPLEFS_HASH_EOF 0x7fffffff
+
 #define SIMPLEFS_VDIR 2
 #define SIMPLEFS_VREG 1
 
+/* simplefs_inode i_flags */
+#define SIMPLEFS_INDEX_FL	0x0001	/* directory is hash indexed */
+#define SIMPLEFS_INLINE_DATA_FL	0x0002	/* file data lives in i_data */
+
+/* A run of physically contiguous blocks backing part of a file.
+ * Extents of an inode are kept sorted by ee_block and never overlap. */
+struct simplefs_extent {
+	uint32_t ee_block;	/* first logical block */
+	uint32_t ee_len;	/* number of blocks */
+	uint64_t ee_start;	/* first physical block */
+};
+
+/* The top bit of ee_len marks an unwritten extent: allocated ahead by
+ * fallocate and read as zeros until data is written to it */
+#define SIMPLEFS_EXT_UNWRITTEN	0x80000000U
+#define SIMPLEFS_EXT_MAX_LEN	(SIMPLEFS_EXT_UNWRITTEN - 1)
+
+/* Extents stored directly in the on-disk inode */
+#define SIMPLEFS_INODE_EXTENTS 2
+
+/* Bytes of file data a 256-byte on-disk inode can hold in place of its extents */
+#define SIMPLEFS_INLINE_SIZE 184
+
+/* Once an inode needs more than SIMPLEFS_INODE_EXTENTS extents the whole
+ * map moves to an extent block referenced by i_extent_block */
+struct simplefs_extent_block {
+	uint32_t eb_count;
+	uint32_t eb_reserved;
+	uint64_t eb_reserved2;
+	struct simplefs_extent eb_extent[];
+};
+
+#define SIMPLEFS_EXTENTS_PER_BLOCK \
+	((SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(struct simplefs_extent_block)) / sizeof(struct simplefs_extent))
+
 struct simplefs_inode {
-	mode_t mode;
+	uint16_t mode;
+	uint16_t i_flags;
 	uint16_t i_nlink;
+	uint16_t i_extent_count;
 	uint64_t inode_no;
-	uint64_t data_block_number;
+	uint64_t i_extent_block;
 
 	union {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+	/* seconds and nanoseconds since the epoch */
+	int64_t i_atime;
+	int64_t i_mtime;
+	int64_t i_ctime;
+	uint32_t i_atime_nsec;
+	uint32_t i_mtime_nsec;
+	uint32_t i_ctime_nsec;
+	uint32_t i_reserved;
+	/* i_data holds the whole file when SIMPLEFS_INLINE_DATA_FL is set */
+	union {
+		struct simplefs_extent i_extent[SIMPLEFS_INODE_EXTENTS];
+		char i_data[SIMPLEFS_INLINE_SIZE];
+	};
 };
 
 struct simplefs_inode_info {
-	uint64_t data_block_number;
-	union {
-		uint64_t file_size;
-		uint64_t dir_children_count;
-	};
+	/* points at i_extent_inline, or at a copy of the extent block */
+	struct simplefs_extent *i_extent;
+	unsigned int i_extent_count;
+	uint64_t i_extent_block;
+	struct simplefs_extent i_extent_inline[SIMPLEFS_INODE_EXTENTS];
+	struct rw_semaphore i_extent_sem;
+	/* DAX faults hold it shared, truncate and zero-range exclusive */
+	struct rw_semaphore i_dax_sem;
+	/* serializes updates of this inode's slot in the inode table */
+	spinlock_t i_raw_lock;
+	unsigned int i_flags;
+	/* last transaction that changed the inode, for fsync */
+	tid_t i_sync_tid;
+	uint64_t dir_children_count;
+	/* logical blocks written into a hole but not allocated yet */
+	struct xarray i_delalloc;
+	/* file contents while SIMPLEFS_INLINE_DATA_FL is set */
+	char i_inline[SIMPLEFS_INLINE_SIZE];
+	/* jiffies of the last readdir, for spotting stat-after-readdir */
+	unsigned long i_readdir_time;
 	struct inode vfs_inode;
 };
 
-#define SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED 64
-/* min (
-		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode),
-		sizeof(uint64_t) //The free_blocks tracker in the sb
- 	); */
-
 /* FIXME: Move the struct to its own file and not expose the members
  * Always access using the simplefs_sb_* functions and
  * do not access the members directly */
@@ -89,19 +185,107 @@ struct simplefs_super_block {
 	/* FIXME: This should be moved to the inode store and not part of the sb */
 	uint64_t inodes_count;
 
-	//uint64_t free_blocks;
-	int64_t imap;
-	int64_t dmap;
+	uint64_t max_inodes;
+	uint64_t free_inodes;
+	uint64_t blocks_count;
+	uint64_t free_blocks;
+
+	/* on-disk layout, computed by mkfs-simplefs */
+	uint64_t imap_block;
+	uint64_t imap_blocks;
+	uint64_t dmap_block;
+	uint64_t dmap_blocks;
+	uint64_t inodestore_block;
+	uint64_t inodestore_blocks;
+	uint64_t data_block;
 
-	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (6 * sizeof(uint64_t))];
+	/* jbd2 log written by mkfs-simplefs -j, journal_blocks is 0 without one */
+	uint64_t journal_block;
+	uint64_t journal_blocks;
+
+	/* allocation group size chosen by mkfs-simplefs -g, a power of two;
+	 * 0 in images made before it could be chosen */
+	uint64_t blocks_per_group;
+
+	/* first inode table block, counted from inodestore_block, that still
+	 * holds whatever was on the device before mkfs; 0 once all are zeroed */
+	uint64_t itable_uninit;
+
+	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (19 * sizeof(uint64_t))];
+};
+
+/* In-memory copy of an on-disk bitmap, one buffer per bitmap block */
+struct simplefs_bitmap {
+	struct buffer_head **bh;
+	unsigned int blocks;
+	uint64_t nbits;
+};
+
+/* Blocks per allocation group when the super block does not say */
+#define SIMPLEFS_BLOCKS_PER_GROUP 8192
+#define SIMPLEFS_MIN_BLOCKS_PER_GROUP 1024
+#define SIMPLEFS_MAX_BLOCKS_PER_GROUP (1 << 20)
+
+/* Allocation group, built at mount time; see balloc.c */
+struct simplefs_group {
+	spinlock_t lock;	/* the group's bits in both bitmaps, and the counts */
+	unsigned int free_blocks;
+	unsigned int free_inodes;
+	unsigned int dirs;
 };
 
 struct simplefs_sb_info {
 	struct buffer_head *sbh;
 	struct simplefs_super_block *sb;
-	struct mutex simplefs_lock;
+	struct simplefs_bitmap imap;
+	struct simplefs_bitmap dmap;
+	struct simplefs_group *s_groups;
+	unsigned int s_groups_count;
+	unsigned int s_blocks_per_group;	/* a power of two */
+	unsigned int s_inodes_per_group;	/* a power of two */
+	/* the group each CPU last had to move on to */
+	unsigned int __percpu *s_group_hint;
+	/* totals; the super block copies are only written back on sync */
+	struct percpu_counter s_free_blocks;
+	struct percpu_counter s_free_inodes;
+	/* free blocks held back for delayed allocation */
+	struct percpu_counter s_reserved_blocks;
+	/* zeroes the inode table past sb->itable_uninit */
+	struct task_struct *s_lazyinit;
+	/* inode table blocks, pinned for the life of the mount */
+	struct buffer_head **itable;
+	/* NULL unless mounted with -o journal */
+	journal_t *journal;
+	/* set when mounted with -o dax */
+	struct dax_device *s_daxdev;
+	unsigned int s_mount_opt;
+	unsigned int s_commit_interval;	/* seconds, 0 for the jbd2 default */
+	/* turns unwritten extents into written ones once their data is on disk */
+	struct workqueue_struct *s_unwritten_wq;
+	/* lookups that followed a readdir of their directory, decaying */
+	atomic_t s_dirplus_hits;
 };
 
+/* s_mount_opt */
+#define SIMPLEFS_MOUNT_JOURNAL	0x0001
+#define SIMPLEFS_MOUNT_DAX	0x0002
+#define SIMPLEFS_MOUNT_DIRPLUS	0x0004
+
+/* simplefs_dir_iterate() @plus: read ahead for the inodes it returns,
+ * and also load them into the inode cache */
+#define SIMPLEFS_DIRPLUS_RA	1
+#define SIMPLEFS_DIRPLUS_ICACHE	2
+
+/* DAX files start on this many blocks (2 MiB) so that PMD faults can map them */
+#define SIMPLEFS_DAX_ALIGN	512
+
+/* Journal credits: buffers one handle may dirty */
+#define SIMPLEFS_INODE_CREDITS	2	/* inode table block, extent block */
+#define SIMPLEFS_MAP_CREDITS	8	/* allocation, spill, the inode */
+#define SIMPLEFS_FREE_CREDITS	3	/* one bitmap block, super block, slack */
+#define SIMPLEFS_EVICT_CREDITS	16
+#define SIMPLEFS_DIROP_CREDITS	32	/* a name, its inode and index splits */
+
 static inline struct simplefs_inode_info *simplefs_i(struct inode *inode)
 {
 	return container_of(inode, struct simplefs_inode_info, vfs_inode);
@@ -112,24 +296,127 @@ static inline struct simplefs_sb_info *simplefs_sb(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+static inline bool simplefs_has_inline(struct inode *inode)
+{
+	return simplefs_i(inode)->i_flags & SIMPLEFS_INLINE_DATA_FL;
+}
+
+static inline uint32_t simplefs_ext_len(const struct simplefs_extent *ext)
+{
+	return ext->ee_len & ~SIMPLEFS_EXT_UNWRITTEN;
+}
+
+static inline bool simplefs_ext_unwritten(const struct simplefs_extent *ext)
+{
+	return ext->ee_len & SIMPLEFS_EXT_UNWRITTEN;
+}
+
 #define SIMPLEFS_INODES_PER_BLOCK ((SIMPLEFS_DEFAULT_BLOCK_SIZE)/(sizeof(struct simplefs_inode)))
 #define simplefs_test_and_clear_bit(nr, addr) \
         __test_and_clear_bit((nr), (unsigned long *)(addr))
 
+/* simplefs_map_blocks() results: freshly allocated blocks, and blocks of
+ * an unwritten extent */
+#define SIMPLEFS_MAP_NEW 1
+#define SIMPLEFS_MAP_UNWRITTEN 2
+
+/* simplefs_map_blocks() @create: allocate written, or unwritten blocks,
+ * or written blocks out of the delayed allocation reservation */
+#define SIMPLEFS_MAP_CREATE 1
+#define SIMPLEFS_MAP_PREALLOC 2
+#define SIMPLEFS_MAP_DELALLOC 3
+
 /* inode.c */
 extern struct inode *simplefs_iget(struct super_block *sb, unsigned long ino);
+extern void simplefs_set_aops(struct inode *inode);
+extern struct simplefs_inode *simplefs_raw_inode(struct super_block *sb,
+		unsigned long ino, struct buffer_head **p);
 extern void simplefs_dump_imap(const char *, struct super_block *);
+extern void simplefs_inode_readahead(struct super_block *sb, unsigned long ino);
+
+/* balloc.c */
+extern int simplefs_new_blocks(struct super_block *sb, sector_t goal,
+		unsigned int *count, sector_t *start, unsigned int reserved);
+extern int simplefs_free_blocks(struct super_block *sb, sector_t start,
+		unsigned int count);
+extern sector_t simplefs_data_goal(struct inode *inode);
+extern unsigned long simplefs_new_inode_no(struct super_block *sb,
+		struct inode *dir, umode_t mode);
+extern int simplefs_free_inode_no(struct super_block *sb, unsigned long ino,
+		umode_t mode);
+extern void simplefs_zero_free_inodes(struct super_block *sb, struct buffer_head *bh,
+		unsigned long ino);
+extern int simplefs_reserve_blocks(struct super_block *sb, unsigned int count);
+extern void simplefs_release_blocks(struct super_block *sb, unsigned int count);
+extern int simplefs_load_bitmaps(struct super_block *sb);
+extern void simplefs_put_bitmaps(struct super_block *sb);
+extern void simplefs_sync_counts(struct super_block *sb);
+
+/* extent.c */
+extern int simplefs_map_blocks(struct inode *inode, sector_t iblock,
+		unsigned int *len, sector_t *phys, int create);
+extern int simplefs_ext_load(struct inode *inode, struct simplefs_inode *sinode);
+extern int simplefs_ext_store(struct inode *inode, struct simplefs_inode *sinode,
+		int sync);
+extern int simplefs_ext_free(struct inode *inode);
+extern int simplefs_ext_truncate(struct inode *inode, sector_t from);
+extern void simplefs_ext_release(struct simplefs_inode_info *sinfo);
+extern sector_t simplefs_ext_end(struct inode *inode);
+extern int simplefs_ext_convert(struct inode *inode, sector_t iblock,
+		sector_t len, bool unwritten);
+extern int simplefs_da_reserve(struct inode *inode, sector_t iblock, unsigned int len);
+extern void simplefs_da_release(struct inode *inode, sector_t iblock, unsigned int len);
+extern void simplefs_da_truncate(struct inode *inode, sector_t from);
+extern void simplefs_da_drop(struct inode *inode);
+
+/* journal.c */
+extern int simplefs_journal_load(struct super_block *sb);
+extern void simplefs_journal_destroy(struct super_block *sb);
+extern void simplefs_journal_abort(struct super_block *sb, int err);
+extern handle_t *simplefs_journal_start(struct super_block *sb, int credits);
+extern int simplefs_journal_stop(handle_t *handle);
+extern int simplefs_journal_ensure_credits(int credits);
+extern int simplefs_get_write_access(struct buffer_head *bh);
+extern int simplefs_get_create_access(struct buffer_head *bh);
+extern void simplefs_dirty_metadata(struct buffer_head *bh, struct inode *inode);
+extern void simplefs_sync_metadata(struct buffer_head *bh);
+extern void simplefs_forget_block(struct super_block *sb, sector_t blk);
+
+/* htree.c */
+extern struct buffer_head *simplefs_find_entry(struct inode *dir,
+		const struct qstr *child, struct simplefs_dir_record **res_dir);
+extern int simplefs_add_entry(struct inode *dir, const struct qstr *child,
+		struct inode *inode);
+extern int simplefs_delete_entry(struct buffer_head *bh, struct inode *dir,
+		struct simplefs_dir_record *drecord);
+extern int simplefs_dir_iterate(struct file *file, struct dir_context *ctx,
+		int plus);
+extern loff_t simplefs_dir_llseek(struct file *file, loff_t offset, int whence);
+
+/* inline.c */
+extern int simplefs_inline_readpage(struct inode *inode, struct page *page);
+extern int simplefs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags, struct page **pagep,
+		void **fsdata);
+extern int simplefs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied, struct page *page,
+		void *fsdata);
+extern int simplefs_inline_convert(struct inode *inode);
+extern int simplefs_inline_truncate(struct inode *inode, loff_t size);
 
 /* file.c */
 extern const struct inode_operations simplefs_file_inops;
 extern const struct file_operations simplefs_file_operations;
 extern const struct address_space_operations simplefs_aops;
 extern const struct address_space_operations simplefs_dax_aops;
+extern const struct iomap_ops simplefs_iomap_ops;
+extern int simplefs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
 /* dir.c */
 extern const struct inode_operations simplefs_dir_inops;
 extern const struct file_operations simplefs_dir_operations;
 
 extern const struct inode_operations simplefs_symlink_inops;
+extern const struct inode_operations simplefs_fast_symlink_inops;
 
 #endif
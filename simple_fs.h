@@ -1,6 +1,9 @@
 #define SIMPLEFS_MAGIC 0x10032013
+/* bumped when the on-disk layout changes; 2: 128-byte inodes,
+ * 3: variable-length directory records, 4: 256-byte inodes with times */
+#define SIMPLEFS_VERSION 4
 #define SIMPLEFS_DEFAULT_BLOCK_SIZE 4096
-#define SIMPLEFS_FILENAME_MAXLEN 24
+#define SIMPLEFS_FILENAME_MAXLEN 255
 #define SIMPLEFS_START_INO 10
 #define SIMPLEFS_ROOTDIR_INO 1
 /**
@@ -25,46 +28,127 @@
 /* Hard-coded inode number for the root directory */
 const int SIMPLEFS_ROOTDIR_INODE_NUMBER = 1;
 
-const int SIMPLEFS_LAST_INODE_NUMBER = 64;
-
 /* The disk block where super block is stored */
 const int SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 
-/* The disk block where the inodes are stored */
-const int SIMPLEFS_INODESTORE_BLOCK_NUMBER = 1;
+/* The first inode bitmap block; the block bitmap, the inode store and
+ * the data blocks follow at offsets recorded in the super block */
+const int SIMPLEFS_IMAP_BLOCK_NUMBER = 1;
 
-/* The disk block where the name+inode_number pairs of the
- * contents of the root directory are stored */
-const int SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER = 2;
+/* Blocks per allocation group, unless mkfs-simplefs -g says otherwise */
+#define SIMPLEFS_BLOCKS_PER_GROUP 8192
+#define SIMPLEFS_MIN_BLOCKS_PER_GROUP 1024
+#define SIMPLEFS_MAX_BLOCKS_PER_GROUP (1 << 20)
 
 /* The name+inode_number pair for each file in a directory.
- * This gets stored as the data for a directory */
+ * This gets stored as the data for a directory: each block is a chain of
+ * records reaching exactly to its end, rec_len leading from one to the
+ * next.  A record may have slack after its name, and one with a zero
+ * inode_no is free space. */
 struct simplefs_dir_record {
 	uint64_t inode_no;
-	char filename[SIMPLEFS_FILENAME_MAXLEN];
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;	/* FT_* of fs_types.h, as in ext2 */
+	char filename[];	/* name_len bytes, no NUL */
+};
+
+/* file_type values used by mkfs-simplefs and fsck-simplefs */
+#define SIMPLEFS_FT_REG_FILE	1
+#define SIMPLEFS_FT_DIR		2
+#define SIMPLEFS_FT_SYMLINK	7
+
+/* Records start 8-byte aligned */
+#define SIMPLEFS_DIR_REC_LEN(name_len) \
+	((offsetof(struct simplefs_dir_record, filename) + (name_len) + 7) & ~7)
+
+/* Directories flagged SIMPLEFS_INDEX_FL keep the root of a hash index in
+ * block 0.  Each index block holds simplefs_dx_entry pairs sorted by hash;
+ * an entry covers the names hashing from its hash up to the next one. */
+struct simplefs_dx_entry {
+	uint32_t hash;
+	uint32_t block;		/* logical block in the directory */
+};
+
+struct simplefs_dx_node {
+	uint16_t dx_count;
+	uint8_t dx_levels;	/* root only: index node levels below the root */
+	uint8_t dx_reserved;
+	uint32_t dx_reserved2;
+	struct simplefs_dx_entry dx_entry[];
 };
 
+#define SIMPLEFS_DX_LIMIT \
+	((SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(struct simplefs_dx_node)) / sizeof(struct simplefs_dx_entry))
+#define SIMPLEFS_DX_MAX_LEVELS 1
+
+/* Name hashes lie below this value */
+#define SIMPLEFS_HASH_EOF 0x7fffffff
+
 #define SIMPLEFS_VDIR 2
 #define SIMPLEFS_VREG 1
 
+/* simplefs_inode i_flags */
+#define SIMPLEFS_INDEX_FL	0x0001	/* directory is hash indexed */
+#define SIMPLEFS_INLINE_DATA_FL	0x0002	/* file data lives in i_data */
+
+/* A run of physically contiguous blocks backing part of a file.
+ * Extents of an inode are kept sorted by ee_block and never overlap. */
+struct simplefs_extent {
+	uint32_t ee_block;	/* first logical block */
+	uint32_t ee_len;	/* number of blocks */
+	uint64_t ee_start;	/* first physical block */
+};
+
+/* The top bit of ee_len marks an unwritten extent, read as zeros */
+#define SIMPLEFS_EXT_UNWRITTEN	0x80000000U
+#define SIMPLEFS_EXT_MAX_LEN	(SIMPLEFS_EXT_UNWRITTEN - 1)
+
+/* Extents stored directly in the on-disk inode */
+#define SIMPLEFS_INODE_EXTENTS 2
+
+/* Bytes of file data a 256-byte on-disk inode can hold in place of its extents */
+#define SIMPLEFS_INLINE_SIZE 184
+
+/* Once an inode needs more than SIMPLEFS_INODE_EXTENTS extents the whole
+ * map moves to an extent block referenced by i_extent_block */
+struct simplefs_extent_block {
+	uint32_t eb_count;
+	uint32_t eb_reserved;
+	uint64_t eb_reserved2;
+	struct simplefs_extent eb_extent[];
+};
+
+#define SIMPLEFS_EXTENTS_PER_BLOCK \
+	((SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(struct simplefs_extent_block)) / sizeof(struct simplefs_extent))
+
 struct simplefs_inode {
-	mode_t mode;
+	uint16_t mode;
+	uint16_t i_flags;
 	uint16_t i_nlink;
+	uint16_t i_extent_count;
 	uint64_t inode_no;
-	uint64_t data_block_number;
+	uint64_t i_extent_block;
 
 	union {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+	/* seconds and nanoseconds since the epoch */
+	int64_t i_atime;
+	int64_t i_mtime;
+	int64_t i_ctime;
+	uint32_t i_atime_nsec;
+	uint32_t i_mtime_nsec;
+	uint32_t i_ctime_nsec;
+	uint32_t i_reserved;
+	/* i_data holds the whole file when SIMPLEFS_INLINE_DATA_FL is set */
+	union {
+		struct simplefs_extent i_extent[SIMPLEFS_INODE_EXTENTS];
+		char i_data[SIMPLEFS_INLINE_SIZE];
+	};
 };
 
-const int SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
-/* min (
-		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode),
-		sizeof(uint64_t) //The free_blocks tracker in the sb
- 	); */
-
 /* FIXME: Move the struct to its own file and not expose the members
  * Always access using the simplefs_sb_* functions and
  * do not access the members directly */
@@ -76,9 +160,31 @@ struct simplefs_super_block {
 	/* FIXME: This should be moved to the inode store and not part of the sb */
 	uint64_t inodes_count;
 
-	//uint64_t free_blocks;
-        int64_t imap;
-        int64_t dmap;
+	uint64_t max_inodes;
+	uint64_t free_inodes;
+	uint64_t blocks_count;
+	uint64_t free_blocks;
+
+	/* on-disk layout, computed by mkfs-simplefs */
+	uint64_t imap_block;
+	uint64_t imap_blocks;
+	uint64_t dmap_block;
+	uint64_t dmap_blocks;
+	uint64_t inodestore_block;
+	uint64_t inodestore_blocks;
+	uint64_t data_block;
+
+	/* jbd2 log written by mkfs-simplefs -j, journal_blocks is 0 without one */
+	uint64_t journal_block;
+	uint64_t journal_blocks;
+
+	/* allocation group size chosen by mkfs-simplefs -g, a power of two;
+	 * 0 in images made before it could be chosen */
+	uint64_t blocks_per_group;
+
+	/* first inode table block, counted from inodestore_block, that still
+	 * holds whatever was on the device before mkfs; 0 once all are zeroed */
+	uint64_t itable_uninit;
 
-	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (6 * sizeof(uint64_t))];
+	char padding[SIMPLEFS_DEFAULT_BLOCK_SIZE - (19 * sizeof(uint64_t))];
 };
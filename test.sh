@@ -1,4 +1,5 @@
 rmmod simplefs 
+modprobe jbd2
 insmod simplefs.ko 
 dd if=/dev/zero of=./image bs=4096 count=1024
 ../simplefs/mkfs-simplefs ./image
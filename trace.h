@@ -0,0 +1,279 @@
+/*
+ * Tracepoints on the simplefs hot paths, under events/simplefs/ in tracefs
+ * and usable from perf and bpftrace.  A disabled tracepoint costs a static
+ * branch; the arguments are only evaluated once one is enabled.  inode.c
+ * defines CREATE_TRACE_POINTS before including this file.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefs
+
+#if !defined(_SIMPLEFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIMPLEFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+TRACE_EVENT(simplefs_map_blocks,
+	TP_PROTO(struct inode *inode, sector_t iblock, unsigned int len,
+		 sector_t phys, int create, int ret),
+	TP_ARGS(inode, iblock, len, phys, create, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, iblock)
+		__field(unsigned int, len)
+		__field(sector_t, phys)
+		__field(int, create)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->iblock = iblock;
+		__entry->len = len;
+		__entry->phys = phys;
+		__entry->create = create;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu lblk %llu len %u pblk %llu create %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  (unsigned long long)__entry->iblock, __entry->len,
+		  (unsigned long long)__entry->phys, __entry->create, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_new_blocks,
+	TP_PROTO(struct super_block *sb, sector_t goal, sector_t start,
+		 unsigned int count, int ret),
+	TP_ARGS(sb, goal, start, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, goal)
+		__field(sector_t, start)
+		__field(unsigned int, count)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->goal = goal;
+		__entry->start = start;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d goal %llu block %llu count %u ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->goal,
+		  (unsigned long long)__entry->start, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_free_blocks,
+	TP_PROTO(struct super_block *sb, sector_t start, unsigned int count),
+	TP_ARGS(sb, start, count),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, start)
+		__field(unsigned int, count)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->start = start;
+		__entry->count = count;
+	),
+
+	TP_printk("dev %d,%d block %llu count %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->start, __entry->count)
+);
+
+DECLARE_EVENT_CLASS(simplefs_inode_no,
+	TP_PROTO(struct super_block *sb, unsigned long ino, umode_t mode),
+	TP_ARGS(sb, ino, mode),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(umode_t, mode)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->mode = mode;
+	),
+
+	TP_printk("dev %d,%d ino %lu mode 0%o",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->mode)
+);
+
+/* ino is 0 when no inode was free */
+DEFINE_EVENT(simplefs_inode_no, simplefs_new_inode,
+	TP_PROTO(struct super_block *sb, unsigned long ino, umode_t mode),
+	TP_ARGS(sb, ino, mode)
+);
+
+DEFINE_EVENT(simplefs_inode_no, simplefs_free_inode,
+	TP_PROTO(struct super_block *sb, unsigned long ino, umode_t mode),
+	TP_ARGS(sb, ino, mode)
+);
+
+/* scanned counts the records of the leaf walked before the name was found */
+TRACE_EVENT(simplefs_find_entry,
+	TP_PROTO(struct inode *dir, const unsigned char *name, int len,
+		 uint32_t block, unsigned int scanned, unsigned long ino),
+	TP_ARGS(dir, name, len, block, scanned, ino),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(uint32_t, block)
+		__field(unsigned int, scanned)
+		__field(unsigned long, ino)
+		__dynamic_array(char, name, len + 1)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->block = block;
+		__entry->scanned = scanned;
+		__entry->ino = ino;
+		memcpy(__get_dynamic_array(name), name, len);
+		((char *)__get_dynamic_array(name))[len] = '\0';
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s leaf %u scanned %u ino %lu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->block, __entry->scanned, __entry->ino)
+);
+
+DECLARE_EVENT_CLASS(simplefs_dirent,
+	TP_PROTO(struct inode *dir, const unsigned char *name, int len,
+		 unsigned long ino, int ret),
+	TP_ARGS(dir, name, len, ino, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(unsigned long, ino)
+		__field(int, ret)
+		__dynamic_array(char, name, len + 1)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->ret = ret;
+		memcpy(__get_dynamic_array(name), name, len);
+		((char *)__get_dynamic_array(name))[len] = '\0';
+	),
+
+	TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->ret)
+);
+
+DEFINE_EVENT(simplefs_dirent, simplefs_add_entry,
+	TP_PROTO(struct inode *dir, const unsigned char *name, int len,
+		 unsigned long ino, int ret),
+	TP_ARGS(dir, name, len, ino, ret)
+);
+
+DEFINE_EVENT(simplefs_dirent, simplefs_delete_entry,
+	TP_PROTO(struct inode *dir, const unsigned char *name, int len,
+		 unsigned long ino, int ret),
+	TP_ARGS(dir, name, len, ino, ret)
+);
+
+TRACE_EVENT(simplefs_write_inode,
+	TP_PROTO(struct inode *inode, int sync, int ret),
+	TP_ARGS(inode, sync, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, size)
+		__field(int, sync)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->size = inode->i_size;
+		__entry->sync = sync;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %lu size %lld sync %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->size, __entry->sync, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_evict_inode,
+	TP_PROTO(struct inode *inode),
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(unsigned int, nlink)
+		__field(blkcnt_t, blocks)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nlink = inode->i_nlink;
+		__entry->blocks = inode->i_blocks;
+	),
+
+	TP_printk("dev %d,%d ino %lu nlink %u blocks %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->nlink, (unsigned long long)__entry->blocks)
+);
+
+/* pos is the directory cookie readdir resumes at, see htree.c */
+TRACE_EVENT(simplefs_readdir,
+	TP_PROTO(struct inode *dir, loff_t start, loff_t end, int plus, int ret),
+	TP_ARGS(dir, start, end, plus, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(loff_t, start)
+		__field(loff_t, end)
+		__field(int, plus)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->start = start;
+		__entry->end = end;
+		__entry->plus = plus;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d dir %lu pos %lld..%lld plus %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->start, __entry->end, __entry->plus, __entry->ret)
+);
+
+#endif /* _SIMPLEFS_TRACE_H */
+
+/* this has to be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>